@@ -0,0 +1,46 @@
+#include <string.h>
+#include <util/atomic.h>
+#include "counters.h"
+
+/*
+ * Performance counters are updated in place and mapped as a register page.
+ * The host reads them through a snapshot, which is taken and the counters
+ * reset in one atomic step: no event is lost between reading and clearing.
+ */
+
+volatile counters_t counters;
+#ifndef TRACE
+counters_t counters_snapshot;
+#endif
+
+void counters_take_snapshot(void)
+{
+    uint16_t loop_rate, restore_time;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        // these are not counters, keep them
+        loop_rate = counters.LOOP_RATE;
+        restore_time = counters.RESTORE_TIME;
+#ifndef TRACE
+        memcpy(&counters_snapshot, (const void *)&counters, sizeof(counters_t));
+#endif
+        memset((void *)&counters, 0, sizeof(counters_t));
+        counters.LOOP_RATE = loop_rate;
+        counters.RESTORE_TIME = restore_time;
+    }
+}
+
+// called once per main loop iteration
+void counters_loop(uint32_t now)
+{
+    static uint16_t loops;
+    static uint8_t second;
+
+    loops++;
+    if ((uint8_t)(now-second)>=25)
+    {
+        counters.LOOP_RATE = loops;
+        loops = 0;
+        second = now;
+    }
+}
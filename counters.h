@@ -0,0 +1,65 @@
+#ifndef _COUNTERS_H_
+#define _COUNTERS_H_
+
+#include <stdint.h>
+
+typedef struct {
+    uint16_t TRANSACTIONS;
+        // number of I2C transactions addressed to the PiWatcher
+
+    uint16_t NACKS;
+        // number of I2C transactions addressed to another device
+
+    uint16_t OVERRUNS;
+        // number of bytes written past the end of the registers and dropped
+
+    uint16_t SYNCS;
+        // number of calls to registers_sync()
+
+    uint16_t EEPROM_WRITES;
+        // number of EEPROM write operations
+
+    uint16_t WATCHDOG_EXPIRIES;
+        // number of times the watchdog expired
+
+    uint16_t REBOOTS;
+        // number of timed power cycles of the Pi
+
+    uint16_t LOOP_RATE;
+        // main loop iterations during the last second
+
+    uint16_t RESTORE_TIME;
+        // ticks between the trigger and DRIVE being switched back on, for
+        // the last power restore: the reset on a cold boot or a watchdog
+        // resume, the wake-up from power down, the end of the off time on
+        // a timer reboot, the press on a button reboot (both button paths
+        // include the BUTTON_DEBOUNCE_TICKS debounce), saturates at 0xFFFF
+
+    uint16_t ISR_MAX;
+        // longest wait for a start condition to complete in the USI start
+        // ISR, in polling iterations (approx 1us each), the only ISR 
+        // without a fixed duration
+
+    uint16_t MISSED_TICKS;
+        // timer ticks that were late by a full period or more and were
+        // caught up from the Timer1 counter
+
+} __attribute__ ((__packed__)) counters_t;
+
+extern volatile counters_t counters;
+
+#ifndef TRACE
+extern counters_t counters_snapshot;
+#else
+// no RAM for a copy in a TRACE build: a snapshot only clears the counters
+#define counters_snapshot counters
+#endif
+
+// saturating increment
+#define COUNTER_INC(c) do { if (counters.c!=0xFFFF) counters.c++; } while (0)
+
+void counters_take_snapshot(void);
+
+void counters_loop(uint32_t now);
+
+#endif
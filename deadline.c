@@ -0,0 +1,74 @@
+#include "deadline.h"
+
+static uint8_t deadline_mask;
+static uint8_t deadline_head = DEADLINE_NONE;
+// kept across a watchdog reset, for power_resume() (see deadline_time())
+static uint32_t deadline_at[DEADLINE_COUNT] __attribute__ ((section (".noinit")));
+
+// tick values are compared modulo 2^32
+static void deadline_find_head(void)
+{
+    uint8_t id;
+
+    deadline_head = DEADLINE_NONE;
+    for (id=0; id<DEADLINE_COUNT; id++)
+    {
+        if ((deadline_mask & (1<<id)) && (deadline_head==DEADLINE_NONE || 
+            (int32_t)(deadline_at[id]-deadline_at[deadline_head])<0))
+            deadline_head = id;
+    }
+}
+
+void deadline_set(uint8_t id, uint32_t at)
+{
+    deadline_at[id] = at;
+    deadline_mask |= (1<<id);
+    if (id==deadline_head)
+        deadline_find_head();
+    else if (deadline_head==DEADLINE_NONE || 
+        (int32_t)(at-deadline_at[deadline_head])<0)
+        deadline_head = id;
+}
+
+void deadline_cancel(uint8_t id)
+{
+    deadline_mask &= ~(1<<id);
+    if (id==deadline_head)
+        deadline_find_head();
+}
+
+uint8_t deadline_pending(uint8_t id)
+{
+    return (deadline_mask>>id) & 1;
+}
+
+// the tick a deadline was set for, still valid once it was popped or 
+// cancelled, and after a watchdog reset
+uint32_t deadline_time(uint8_t id)
+{
+    return deadline_at[id];
+}
+
+// the id of the earliest pending deadline, or DEADLINE_NONE
+uint8_t deadline_next(void)
+{
+    return deadline_head;
+}
+
+// returns the id of the earliest deadline if it expired, or DEADLINE_NONE
+uint8_t deadline_pop(uint32_t now)
+{
+    uint8_t id = deadline_head;
+
+    if (id==DEADLINE_NONE || (int32_t)(now-deadline_at[id])<0)
+        return DEADLINE_NONE;
+    deadline_mask &= ~(1<<id);
+    deadline_find_head();
+    return id;
+}
+
+void deadline_clear(void)
+{
+    deadline_mask = 0;
+    deadline_head = DEADLINE_NONE;
+}
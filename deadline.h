@@ -0,0 +1,37 @@
+#ifndef _DEADLINE_H_
+#define _DEADLINE_H_
+
+#include <stdint.h>
+
+/*
+ * Software timers, one per timed feature, each an absolute tick deadline.
+ * A bit mask tells which are pending and the earliest one is cached, so 
+ * the main loop only checks that one. Expired deadlines are popped 
+ * earliest first.
+ */
+
+#define DEADLINE_STATE      0   // current power state timeout
+#define DEADLINE_BUTTON     1   // long button press
+#define DEADLINE_WATCHDOG   2   // loss of I2C activity
+#define DEADLINE_GRACE      3   // end of the shutdown grace period
+#define DEADLINE_QUIET      4   // I2C silence during the grace period
+#define DEADLINE_SCHEDULE   5   // end of a power schedule on period
+#define DEADLINE_COUNT      6
+
+#define DEADLINE_NONE       0xFF
+
+void deadline_set(uint8_t id, uint32_t at);
+
+void deadline_cancel(uint8_t id);
+
+uint8_t deadline_pending(uint8_t id);
+
+uint32_t deadline_time(uint8_t id);
+
+uint8_t deadline_next(void);
+
+uint8_t deadline_pop(uint32_t now);
+
+void deadline_clear(void);
+
+#endif
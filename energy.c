@@ -0,0 +1,28 @@
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+#include "energy.h"
+
+/*
+ * Every sleep of the firmware goes through these, so that the host
+ * simulation in sim/ can replace them to account for the time spent in 
+ * each sleep mode.
+ */
+
+void energy_sleep(void)
+{
+    sleep_mode();
+}
+
+void energy_power_down(void)
+{
+    cli();
+    sleep_enable();
+#if defined(BODS) && defined(BODSE)
+    // brown-out detector off during sleep, on silicon revisions that support it
+    sleep_bod_disable();
+#endif
+    sei();
+    sleep_cpu();
+    sleep_disable();
+}
@@ -0,0 +1,8 @@
+#ifndef _ENERGY_H_
+#define _ENERGY_H_
+
+void energy_sleep(void);
+
+void energy_power_down(void);
+
+#endif
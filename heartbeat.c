@@ -0,0 +1,57 @@
+#include <string.h>
+#include "heartbeat.h"
+
+#ifndef TRACE
+
+/*
+ * Histogram of the intervals between I2C kicks, used to choose a WATCHDOG
+ * value from observed host behaviour. Several transactions within the same
+ * tick (e.g. a pointer write followed by a read) count as one kick. The
+ * caller measures the interval from its own record of the last activity.
+ */
+
+heartbeat_t heartbeat;  // set up by heartbeat_clear()
+
+static uint8_t heartbeat_started;
+
+void heartbeat_clear(void)
+{
+    memset(&heartbeat, 0, sizeof(heartbeat));
+    heartbeat.MIN = 0xFFFF;
+}
+
+// forget the previous kick, e.g. after the Pi was power cycled
+void heartbeat_restart(void)
+{
+    heartbeat_started = 0;
+}
+
+void heartbeat_kick(uint32_t interval)
+{
+    uint16_t v;
+    uint8_t b = 0;
+
+    if (heartbeat_started && interval==0)
+        return;
+
+    if (!heartbeat_started)
+    {
+        heartbeat_started = 1;
+        return;
+    }
+
+    v = (interval>0xFFFF) ? 0xFFFF : interval;
+
+    for (interval = v>>3; interval && b<HEARTBEAT_BUCKETS-1; interval >>= 1)
+        b++;
+    if (heartbeat.BUCKETS[b]!=0xFFFF)
+        heartbeat.BUCKETS[b]++;
+
+    if (v<heartbeat.MIN)
+        heartbeat.MIN = v;
+    if (v>heartbeat.MAX)
+        heartbeat.MAX = v;
+    heartbeat.LAST = v;
+}
+
+#endif
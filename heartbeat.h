@@ -0,0 +1,46 @@
+#ifndef _HEARTBEAT_H_
+#define _HEARTBEAT_H_
+
+#include <stdint.h>
+
+// a TRACE build has no RAM to spare for the histogram
+#ifndef TRACE
+
+#define HEARTBEAT_BUCKETS 10
+
+typedef struct {
+    uint16_t BUCKETS[HEARTBEAT_BUCKETS];
+        // number of intervals between two I2C kicks, in ticks, saturating
+        // at 0xFFFF: bucket 0 counts intervals below 8 ticks, bucket k 
+        // intervals in [8*2^(k-1), 8*2^k), and the last bucket everything
+        // above.
+
+    uint16_t MIN;
+        // shortest interval, in ticks
+
+    uint16_t MAX;
+        // longest interval, in ticks
+
+    uint16_t LAST;
+        // last interval, in ticks
+
+} __attribute__ ((__packed__)) heartbeat_t;
+
+extern heartbeat_t heartbeat;
+
+void heartbeat_clear(void);
+
+void heartbeat_restart(void);
+
+// interval: ticks since the previous I2C activity
+void heartbeat_kick(uint32_t interval);
+
+#else
+
+#define heartbeat_clear()
+#define heartbeat_restart()
+#define heartbeat_kick(interval)
+
+#endif
+
+#endif
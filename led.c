@@ -0,0 +1,155 @@
+#include <avr/io.h>
+#include <util/atomic.h>
+#include "led.h"
+#include "registers.h"
+
+/*
+ * The LED is on PB1, which is also OC0B. Static and blinking patterns
+ * drive the pin directly from the timer tick, while dimmed patterns
+ * (LEVEL, BREATHE) run Timer0 in fast PWM mode, which is otherwise kept
+ * powered down.
+ */
+
+#define BIT_LED 1
+
+#define BLINK_ON_TICKS      4
+#define BLINK_SLOT_TICKS    8
+#define BLINK_PAUSE_TICKS   24
+
+static volatile uint8_t led_mode;
+static volatile uint8_t led_arg;
+static volatile uint8_t led_phase;
+static volatile uint8_t led_count;
+static volatile uint8_t led_level;
+static volatile int8_t led_dir;
+
+static void led_pin(uint8_t on)
+{
+    if (on)
+        PORTB |= (1<<BIT_LED);
+    else
+        PORTB &= ~(1<<BIT_LED);
+}
+
+static void led_pwm_open(void)
+{
+    PRR &= ~(1<<PRTIM0);
+    OCR0B = 0;
+    TCNT0 = 0;
+    // fast PWM, prescaler = 64 -> approx 488Hz
+    TCCR0A = (1<<WGM01) | (1<<WGM00);
+    TCCR0B = (1<<CS01) | (1<<CS00);
+}
+
+static void led_pwm_close(void)
+{
+    TCCR0A = 0;
+    TCCR0B = 0;
+    PRR |= (1<<PRTIM0);
+}
+
+static void led_pwm(uint8_t duty)
+{
+    // fast PWM still outputs a short pulse for OCR0B=0, so disconnect OC0B
+    if (duty==0)
+    {
+        TCCR0A &= ~(1<<COM0B1);
+        led_pin(0);
+    }
+    else
+    {
+        OCR0B = duty;
+        TCCR0A |= (1<<COM0B1);
+    }
+}
+
+void led_set(uint8_t mode, uint8_t arg)
+{
+    if (mode>LED_MODE_FLASH)
+        mode = LED_MODE_OFF;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        if (mode==LED_MODE_LEVEL || mode==LED_MODE_BREATHE)
+        {
+            if (led_mode!=LED_MODE_LEVEL && led_mode!=LED_MODE_BREATHE)
+                led_pwm_open();
+        }
+        else
+        {
+            led_pwm_close();
+        }
+
+        led_mode = mode;
+        led_arg = arg;
+        led_phase = 0;
+        led_count = 0;
+        led_level = 0;
+        led_dir = 1;
+
+        switch (mode) {
+            case LED_MODE_ON:
+                led_pin(1);
+                break;
+            case LED_MODE_LEVEL:
+                led_pwm(arg);
+                break;
+            case LED_MODE_BREATHE:
+                led_pwm(0);
+                break;
+            default:
+                led_pin(0);
+                break;
+        }
+
+        out_regs.LED = in_regs.LED = mode;
+        out_regs.LED_ARG = in_regs.LED_ARG = arg;
+    }
+}
+
+// called from the timer interrupt, 25 times per second
+void led_tick(void)
+{
+    uint16_t level;
+
+    switch (led_mode) {
+        case LED_MODE_BREATHE:
+            level = led_level + (int16_t)led_dir * (led_arg ? led_arg : 1);
+            if (level > 0xFF)
+            {
+                // reflect at both ends of the ramp
+                led_dir = -led_dir;
+                level = (led_dir<0) ? 0xFF : 0;
+            }
+            led_level = level;
+            // square the ramp for a perceptually smoother fade
+            led_pwm(((uint16_t)led_level * led_level) >> 8);
+            break;
+        case LED_MODE_BLINK:
+            if (led_count < led_arg)
+            {
+                led_pin(led_phase < BLINK_ON_TICKS);
+                if (++led_phase >= BLINK_SLOT_TICKS)
+                {
+                    led_phase = 0;
+                    led_count++;
+                }
+            }
+            else
+            {
+                led_pin(0);
+                if (++led_phase >= BLINK_PAUSE_TICKS)
+                {
+                    led_phase = 0;
+                    led_count = 0;
+                }
+            }
+            break;
+        case LED_MODE_FLASH:
+            if (++led_phase >= led_arg)
+            {
+                led_phase = 0;
+                PORTB ^= (1<<BIT_LED);
+            }
+            break;
+    }
+}
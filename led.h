@@ -0,0 +1,17 @@
+#ifndef _LED_H_
+#define _LED_H_
+
+#include <stdint.h>
+
+#define LED_MODE_OFF        0
+#define LED_MODE_ON         1
+#define LED_MODE_LEVEL      2   // arg: duty cycle (0-255)
+#define LED_MODE_BREATHE    3   // arg: brightness step per tick
+#define LED_MODE_BLINK      4   // arg: number of blinks before a pause
+#define LED_MODE_FLASH      5   // arg: ticks between toggles
+
+void led_set(uint8_t mode, uint8_t arg);
+
+void led_tick(void);
+
+#endif
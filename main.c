@@ -1,9 +1,16 @@
 #include <avr/io.h>
 #include <avr/interrupt.h>
-#include <util/delay.h>
 #include "timer.h"
 #include "twi_slave.h"
+#include "led.h"
+#include "energy.h"
+#include "schedule.h"
+#include "deadline.h"
+#include "trace.h"
+#include "counters.h"
+#include "heartbeat.h"
 #include <avr/sleep.h>
+#include <avr/wdt.h>
 
 /*
  * PB0  I2C (SDA)
@@ -14,7 +21,9 @@
  * PB5  RESET
  */
 
+#define BIT_SDA 0
 #define BIT_LED 1
+#define BIT_SCL 2
 #define BIT_DRIVE 3
 #define BIT_BUTTON  4
 
@@ -34,12 +43,51 @@
 #define BUTTON_STATE_PRESS_START    1
 #define BUTTON_STATE_PRESS_SHORT    2
 #define BUTTON_STATE_PRESS_LONG     3
+#define BUTTON_STATE_RELEASE        4
+
+#define POWER_STATE_STARTUP         0
+#define POWER_STATE_FACTORY_HOLD    1
+#define POWER_STATE_FACTORY_RESET   2
+#define POWER_STATE_ON              3
+#define POWER_STATE_CUT             4
+#define POWER_STATE_REBOOT_WAIT     5
+#define POWER_STATE_WAKE            6
+
+#define STARTUP_TICKS               6   // 250 ms
+#define FACTORY_HOLD_TICKS          250 // 10 seconds
+#define CUT_TICKS                   3   // 100 ms
+#define WAKE_TICKS                  13  // 500 ms to confirm a button wake
+#define LONG_PRESS_TICKS            75  // 3 seconds
+
+#define GRACE_QUIET_TICKS           50 // 2 seconds of bus silence
+
+#define PERSIST_MAGIC               0x5A
+
+/* 
+ * Kept across a watchdog reset, so the Pi stays in its power state while 
+ * the PiWatcher restarts. Garbage after a power-on, hence the magic value.
+ */
+static struct {
+    uint8_t magic;
+    uint8_t power_state;
+} persist __attribute__ ((section (".noinit")));
+
+static uint8_t reset_cause __attribute__ ((section (".noinit")));
+
+static uint8_t drive_off(uint8_t state)
+{
+    return state==POWER_STATE_CUT || state==POWER_STATE_REBOOT_WAIT || 
+        state==POWER_STATE_WAKE;
+}
 
 static void gpio_init(void)
 {
-    DDRB = (1<<BIT_LED) | (1<<BIT_DRIVE);
+    if (persist.magic==PERSIST_MAGIC && drive_off(persist.power_state))
+        SWITCH_OFF();
+    else
+        SWITCH_ON();
 
-    SWITCH_ON();
+    DDRB = (1<<BIT_LED) | (1<<BIT_DRIVE);
     //PORTB |= (1<<BIT_DRIVE);
 
 
@@ -47,175 +95,508 @@ static void gpio_init(void)
     //GIMSK = (1<<PCIE);     // enable pin change interrupt
 }
 
+/*
+ * Runs before the C runtime initialises memory. A watchdog reset leaves the
+ * watchdog running at its shortest timeout, so stop it first, then set
+ * DRIVE back as soon as possible.
+ */
+void reset_init(void) __attribute__ ((naked, used, section (".init3")));
+void reset_init(void)
+{
+    reset_cause = MCUSR;
+    MCUSR = 0;
+    wdt_disable();
+
+    if (!(reset_cause & (1<<WDRF)))
+        persist.magic = 0;
+    gpio_init();
+}
+
 ISR (PCINT0_vect)
 {
-    /* void */
+    trace_record(TRACE_PCINT, 0, PINB);
 }
 
 
-static void slow_blink(void) 
+static uint8_t power_state;
+static uint8_t button_state;
+static uint16_t watchdog_interval;
+static uint32_t start_timer;
+static uint32_t cut_wait;
+/* kept across a watchdog reset, with out_regs, see power_resume() */
+static uint8_t booted __attribute__ ((section (".noinit")));
+static uint32_t boot_start __attribute__ ((section (".noinit")));
+
+static void power_enter(uint8_t state, uint32_t timeout)
+{
+    power_state = state;
+    persist.power_state = state;
+    if (timeout)
+        deadline_set(DEADLINE_STATE, timer_ticks()+timeout);
+    else
+        deadline_cancel(DEADLINE_STATE);
+
+    if (state!=POWER_STATE_ON)
+    {
+        deadline_cancel(DEADLINE_BUTTON);
+        deadline_cancel(DEADLINE_WATCHDOG);
+        deadline_cancel(DEADLINE_GRACE);
+        deadline_cancel(DEADLINE_QUIET);
+    }
+}
+
+static void watchdog_arm(void)
 {
-    if ((((timer_ticks()))&0x38)==0x30)
-        PORTB |= (1<<BIT_LED);
+    /* BOOT GRACE (LONGER TIMEOUT UNTIL THE HOST FIRST WRITES) */
+    if (!booted && out_regs.DEFAULT_BOOT_GRACE!=0)
+        watchdog_interval = ((uint16_t)out_regs.DEFAULT_BOOT_GRACE)*25;
+    else
+        watchdog_interval = ((uint16_t)out_regs.WATCHDOG)*25;
+
+    if (out_regs.WATCHDOG!=0 && !(out_regs.STATUS & REG_STATUS_SHUTDOWN))
+        deadline_set(DEADLINE_WATCHDOG, start_timer+watchdog_interval+1);
     else
-        PORTB &= ~(1<<BIT_LED);
+        deadline_cancel(DEADLINE_WATCHDOG);
+}
+
+/* 
+ * since: the tick the power restore was triggered at, now if DRIVE was 
+ * already on (from reset, see gpio_init())
+ */
+/* enter the ON state with DRIVE on, for the host as it is */
+static void power_run(void)
+{
+    /* a button still held from the wake-up is not a new press */
+    button_state = button_press ? BUTTON_STATE_RELEASE : BUTTON_STATE_NONE;
+    start_timer = timer_ticks();
+    heartbeat_restart();
+    power_enter(POWER_STATE_ON, 0);
+    watchdog_arm();
+    schedule_power_on(start_timer);
+}
+
+static void power_on(uint8_t boot_status, uint32_t since)
+{
+    uint32_t elapsed;
+
+    SWITCH_ON();
+    elapsed = timer_ticks()-since;
+    counters.RESTORE_TIME = (elapsed>0xFFFF) ? 0xFFFF : elapsed;
+    led_set(LED_MODE_ON, 0);
+    registers_reset();
+    out_regs.STATUS = boot_status;
+    if (boot_status==REG_STATUS_BOOT_BUTTON)
+        out_regs.FAILURES = 0;
+    booted = 0;
+    boot_start = timer_ticks();
+    out_regs.BOOT_TIME = 0;
+    power_run();
 }
 
 static void shutdown(void)
 {
-    PORTB &= ~(1<<BIT_LED);
+    led_set(LED_MODE_OFF, 0);
     SWITCH_OFF();
-    _delay_ms(100);
+    power_enter(POWER_STATE_CUT, CUT_TICKS+1);
+}
+
+static void power_down(void)
+{
     timer_close();
+    twi_close();
+
+    /* 
+     * Minimum current: no pull-ups on the I2C pins of the unpowered Pi, 
+     * digital input buffers off on every pin but the button, and every
+     * peripheral clock stopped.
+     */
+    PORTB &= ~((1<<BIT_SDA) | (1<<BIT_SCL));
+    DIDR0 = (1<<ADC0D) | (1<<ADC3D) | (1<<ADC1D) | (1<<AIN1D) | (1<<AIN0D);
+    PRR = (1<<PRTIM1) | (1<<PRTIM0) | (1<<PRUSI) | (1<<PRADC);
 
     GIMSK = (1<<PCIE);
     PCMSK = (1<<PCINT4);
 
     set_sleep_mode(SLEEP_MODE_PWR_DOWN);
-    sleep_mode();
+    wdt_disable();
+    energy_power_down();
+    wdt_enable(WDTO_1S);
     
     GIMSK = 0;
-    PORTB |= (1<<BIT_LED);
+    set_sleep_mode(SLEEP_MODE_IDLE);
 
-    timer_open();
-    _delay_ms(500);
-    while (button_press);
+    DIDR0 = 0;
+    PRR = (1<<PRTIM0) | (1<<PRADC);
+    led_set(LED_MODE_ON, 0);
 
-    SWITCH_ON();
+    /* the tick counter restarts from 0, so all deadlines are void */
+    out_regs.TICKS = 0;
+    timer_open();
+    deadline_clear();
     twi_init(0x62);
-    registers_reset();
-    out_regs.STATUS = REG_STATUS_BOOT_BUTTON;
+    schedule_init();
+    power_enter(POWER_STATE_WAKE, WAKE_TICKS+1);
 }
 
 static void reboot(uint32_t wait_until)
 {
-    uint32_t start = timer_ticks();
-    
+    COUNTER_INC(REBOOTS);
     SWITCH_OFF();
-    set_sleep_mode(SLEEP_MODE_IDLE);
-    do 
+    led_set(LED_MODE_BLINK, 1);
+    power_enter(POWER_STATE_REBOOT_WAIT, wait_until);
+}
+
+static void power_cut(uint32_t wait)
+{
+    /* REBOOT MODE (POWER BACK ON AFTER WAIT) */
+    if (wait!=0)
     {
-        sleep_mode();
-        slow_blink();
-    } 
-    while ((timer_ticks()-start<wait_until) && (!button_press));
-    PORTB |= (1<<BIT_LED);
-    SWITCH_ON();
-    registers_reset();
-    if (button_press)
+        reboot(wait);
+    }
+    else
+    /* SHUTDOWN MODE (HALT UNTIL BUTTON PRESS) */
+    {
+        shutdown();
+    }
+}
+
+static void power_cut_request(uint32_t wait, uint32_t now)
+{
+    if (out_regs.GRACE!=0)
     {
-        _delay_ms(500);
-        while (button_press);
-        out_regs.STATUS = REG_STATUS_BOOT_BUTTON;
+        out_regs.STATUS |= REG_STATUS_SHUTDOWN;
+        cut_wait = wait;
+        /* the grace period measures silence from the request on */
+        start_timer = now;
+        heartbeat_restart();
+        deadline_cancel(DEADLINE_WATCHDOG);
+        deadline_set(DEADLINE_GRACE, now+((uint32_t)out_regs.GRACE)*25+1);
+        deadline_set(DEADLINE_QUIET, now+GRACE_QUIET_TICKS+1);
     }
     else
     {
-        out_regs.STATUS = REG_STATUS_BOOT_TIMER;
+        power_cut(wait);
+    }
+}
+
+/* off time after a watchdog expiry, 0 to shut down */
+static uint32_t watchdog_backoff(void)
+{
+    uint32_t wait = out_regs.REBOOT;
+    uint16_t cap = out_regs.BACKOFF_CAP ? out_regs.BACKOFF_CAP : 0xFFFF;
+    uint8_t i;
+
+    if (out_regs.FAILURES!=0xFF)
+        out_regs.FAILURES++;
+
+    if (out_regs.FAIL_LIMIT!=0 && out_regs.FAILURES>=out_regs.FAIL_LIMIT)
+        return 0;
+
+    if (out_regs.BACKOFF>1)
+    {
+        for (i=1; i<out_regs.FAILURES && wait<cap; i++)
+            wait *= out_regs.BACKOFF;
+        if (wait>cap)
+            wait = cap;
+    }
+    return wait*50;
+}
+
+/* 
+ * After a watchdog reset, carry on from the power state the Pi was in. The
+ * registers, the tick count and the deadline times were kept.
+ */
+static void power_resume(uint8_t state)
+{
+    uint32_t until = deadline_time(DEADLINE_STATE);
+
+    switch (state) {
+        case POWER_STATE_REBOOT_WAIT:
+            /* the rest of the off time */
+            if ((int32_t)(until-timer_ticks())>0)
+            {
+                led_set(LED_MODE_BLINK, 1);
+                power_enter(POWER_STATE_REBOOT_WAIT, until-timer_ticks());
+            }
+            else
+            {
+                power_on(REG_STATUS_BOOT_TIMER, until);
+            }
+            break;
+        case POWER_STATE_CUT:
+        case POWER_STATE_WAKE:
+            shutdown();
+            break;
+        case POWER_STATE_ON:
+            /* 
+             * the host keeps its WATCHDOG, REBOOT, GRACE, LED and boot
+             * state, a pending power cut is dropped with its grace period
+             */
+            out_regs.STATUS &= ~REG_STATUS_SHUTDOWN;
+            led_set(out_regs.LED, out_regs.LED_ARG);
+            power_run();
+            break;
+        default:
+            power_on(0, timer_ticks());
+            break;
+    }
+}
+
+static void button_update(uint32_t now)
+{
+    switch (button_state) {
+        case BUTTON_STATE_NONE:
+            if (button_press)
+            {
+                deadline_set(DEADLINE_BUTTON, now+LONG_PRESS_TICKS+1);
+                button_state = BUTTON_STATE_PRESS_START;
+            }
+            break;
+        case BUTTON_STATE_PRESS_START:
+            if (!button_press)
+            {
+                out_regs.STATUS |= REG_STATUS_BUTTON;
+                deadline_cancel(DEADLINE_BUTTON);
+                button_state = BUTTON_STATE_NONE;
+            }
+            break;
+        case BUTTON_STATE_PRESS_LONG:
+            if (!button_press)
+            {
+                button_state = BUTTON_STATE_NONE;
+                shutdown();
+            }
+            break;
+        case BUTTON_STATE_RELEASE:
+            if (!button_press)
+            {
+                button_state = BUTTON_STATE_NONE;
+            }
+            break;
+    }
+}
+
+static void state_update(void)
+{
+    switch (power_state) {
+        case POWER_STATE_FACTORY_HOLD:
+            if (!button_press)
+            {
+                if (!deadline_pending(DEADLINE_STATE))
+                {
+                    registers_clear_defaults();
+                    led_set(LED_MODE_FLASH, 12);
+                    power_enter(POWER_STATE_FACTORY_RESET, 0);
+                }
+                else
+                {
+                    power_on(0, timer_ticks());
+                }
+            }
+            break;
+        case POWER_STATE_REBOOT_WAIT:
+            if (button_press)
+            {
+                /* like a wake-up, count from the press, not the debounce */
+                power_on(REG_STATUS_BOOT_BUTTON, timer_ticks()-BUTTON_DEBOUNCE_TICKS);
+            }
+            break;
+        case POWER_STATE_WAKE:
+            /* the debounced button confirms the wake-up, the timer restarted from 0 then */
+            if (button_press)
+            {
+                power_on(REG_STATUS_BOOT_BUTTON, 0);
+            }
+            break;
+    }
+}
+
+static void state_timeout(void)
+{
+    uint32_t wait;
+
+    switch (power_state) {
+        case POWER_STATE_STARTUP:
+            if (button_press)
+                power_enter(POWER_STATE_FACTORY_HOLD, FACTORY_HOLD_TICKS+1);
+            else
+                power_on(0, timer_ticks());
+            break;
+        case POWER_STATE_CUT:
+            power_down();
+            break;
+        case POWER_STATE_REBOOT_WAIT:
+            /* the schedule may want the Pi off by now */
+            wait = schedule_missed(timer_ticks());
+            if (wait==SCHEDULE_SHUTDOWN)
+                shutdown();
+            else if (wait)
+                power_enter(POWER_STATE_REBOOT_WAIT, wait);
+            else
+                power_on(REG_STATUS_BOOT_TIMER, deadline_time(DEADLINE_STATE));
+            break;
+        case POWER_STATE_WAKE:
+            /* spurious wake-up, the button was not held */
+            shutdown();
+            break;
+    }
+}
+
+static void deadline_expired(uint8_t id, uint32_t now)
+{
+    switch (id) {
+        case DEADLINE_STATE:
+            state_timeout();
+            break;
+        case DEADLINE_BUTTON:
+            led_set(LED_MODE_FLASH, 3);
+            button_state = BUTTON_STATE_PRESS_LONG;
+            break;
+        case DEADLINE_WATCHDOG:
+            /* activity since the deadline was set only moves it forward */
+            if ((now-start_timer)>watchdog_interval)
+            {
+                /* WATCHDOG MODE (CUT POWER ON LOSS OF ACTIVITY) */
+                COUNTER_INC(WATCHDOG_EXPIRIES);
+                power_cut_request(watchdog_backoff(), now);
+            }
+            else
+            {
+                watchdog_arm();
+            }
+            break;
+        case DEADLINE_GRACE:
+            power_cut(cut_wait);
+            break;
+        case DEADLINE_QUIET:
+            if ((now-start_timer)>GRACE_QUIET_TICKS)
+                power_cut(cut_wait);
+            else
+                deadline_set(DEADLINE_QUIET, start_timer+GRACE_QUIET_TICKS+1);
+            break;
+        case DEADLINE_SCHEDULE:
+            /* an on period that ends while the Pi is off is picked up by state_timeout() */
+            if (power_state==POWER_STATE_ON)
+                power_cut_request(schedule_power_off(now), now);
+            break;
     }
 }
 
 int main() 
 {
-    uint8_t button_state= BUTTON_STATE_NONE;
-    uint32_t start_timer = 0;
-    uint32_t button_start = 0;
     uint32_t now;
-    uint32_t interval;
-
+    uint8_t status;
+    uint8_t cmd;
+    uint8_t id;
+    uint32_t fed = 0;
 
     /* power reduction efforts */
     ACSR |= (1<<ACD);   // Dissable analog comparator
-    PRR |= (1<<PRTIM0); // Dissable timer/counter 0;
+    PRR |= (1<<PRTIM0); // Dissable timer/counter 0 until the LED needs PWM
     PRR |= (1<<PRADC);  // Dissable ADC
 
-    gpio_init();
+    /* gpio_init() already ran from reset_init() */
     timer_open();
     twi_init(0x62);
-    registers_reset();
+    registers_init(persist.magic==PERSIST_MAGIC);
+    heartbeat_clear();
+    schedule_init();
+    out_regs.RESET_CAUSE = reset_cause;
     
-    _delay_ms(200);
+    wdt_enable(WDTO_1S);
     sei();
-    _delay_ms(50);
-
-
-    now = timer_ticks();
-    while (button_press);
-    if (timer_ticks()-now>250)
-    {
-        registers_clear_defaults();
-        for (;;)
-        {
-            PORTB ^= (1<<BIT_LED);
-            _delay_ms(500); 
-        }
-    }
 
+    if (persist.magic==PERSIST_MAGIC)
+        power_resume(persist.power_state);
+    else
+        power_enter(POWER_STATE_STARTUP, STARTUP_TICKS+1);
+    persist.magic = PERSIST_MAGIC;
+    set_sleep_mode(SLEEP_MODE_IDLE);
 
-    PORTB |= (1<<BIT_LED);
-    
+    /* 
+     * Each iteration runs to completion and the MCU then idles until the 
+     * next interrupt (timer tick or I2C), so register sync and LED feedback
+     * keep running in every state.
+     */
     for (;;)
     {
         now = timer_ticks();
         
         if (twi_has_received()) // there has been a change
         {
-            registers_sync();
+            status = out_regs.STATUS;
+            cmd = registers_sync();
+            heartbeat_kick(now-start_timer);
             start_timer = now;
-        }
 
-        switch (button_state) {
-            case BUTTON_STATE_NONE:
-                if (button_press)
+            if (power_state==POWER_STATE_ON)
+            {
+                if (cmd==REG_CMD_SHUTDOWN)
+                {
+                    power_cut(0);
+                }
+                else if (cmd==REG_CMD_REBOOT)
+                {
+                    power_cut((uint32_t)(out_regs.CMD_ARG ? out_regs.CMD_ARG : out_regs.REBOOT)*50);
+                }
+                /* host acknowledged the shutdown request: it is halted */
+                else if (status & ~out_regs.STATUS & REG_STATUS_SHUTDOWN)
                 {
-                    button_start = now;
-                    button_state = BUTTON_STATE_PRESS_START;
+                    power_cut(cut_wait);
                 }
-                break;
-            case BUTTON_STATE_PRESS_START:
-                interval = now - button_start;
-                if (button_press)
+                else if (!booted)
                 {
-                    if (interval > 75) // 3 seconds = 3*25
-                    {
-                        while (button_press)
-                        {
-                            PORTB ^= (1<<BIT_LED);
-                            _delay_ms(125); 
-                        }
-                        button_state = BUTTON_STATE_NONE;
-                        shutdown();
-                    }
+                    booted = 1;
+                    out_regs.BOOT_TIME = (now-boot_start>0xFFFF) ? 0xFFFF : now-boot_start;
+                    out_regs.FAILURES = 0;
+                    watchdog_arm();
                 }
-                else // !button_press
+                else if (((uint32_t)out_regs.WATCHDOG)*25!=watchdog_interval)
                 {
-                    out_regs.STATUS |= REG_STATUS_BUTTON;
-                    button_state = BUTTON_STATE_NONE;
+                    watchdog_arm();
                 }
-                break;
+            }
+            else if (cmd!=REG_CMD_NONE)
+            {
+                /* power commands only apply while the Pi is on */
+                out_regs.CMD = REG_CMD_REJECTED;
+            }
         }
 
-        if (out_regs.WATCHDOG!=0)
+        if (power_state==POWER_STATE_ON)
         {
-            if (twi_has_transmitted()) {
+            if (twi_has_transmitted())
+            {
+                heartbeat_kick(now-start_timer);
                 start_timer = now;
             }
-            
-            interval = ((uint32_t)out_regs.WATCHDOG)*25;
+            button_update(now);
+        }
+        else
+        {
+            state_update();
+        }
 
-            if ((now-start_timer)>interval)
-            {
-                /* WATCHDOG MODE (REBOOT ON LOSS OF ACTIVITY) */
-                if (out_regs.REBOOT!=0)
-                {
-                    reboot((uint32_t)out_regs.REBOOT*50);
-                    start_timer = timer_ticks();
-                }
-                else
-                /* SHUTDOWN MODE (HALT ON LOSS OF ACTIVITY) */
-                {
-                    shutdown();
-                }
-            }
+        while ((id = deadline_pop(now))!=DEADLINE_NONE)
+        {
+            deadline_expired(id, now);
+            /* power_down() restarts the tick counter from 0 */
+            now = timer_ticks();
         }
+
+        schedule_update(now);
+        counters_loop(now);
+
+        /* 
+         * Only feed the watchdog when ticks advance: a stuck ISR or a 
+         * stopped timer then resets the PiWatcher, DRIVE kept as it is.
+         */
+        if (now!=fed)
+        {
+            wdt_reset();
+            fed = now;
+        }
+
+        energy_sleep();
     }
 }
@@ -1,89 +1,377 @@
 #include "registers.h"
+#include "led.h"
+#include "twi_slave.h"
+#include "schedule.h"
+#include "trace.h"
+#include "counters.h"
+#include "heartbeat.h"
+#include <string.h>
 #include <avr/eeprom.h>
+#include <util/atomic.h>
 
-registers_t out_regs;
-registers_t in_regs;
+// kept across a watchdog reset, with the tick count, see registers_init()
+registers_t out_regs __attribute__ ((section (".noinit")));
+registers_in_t in_regs;
 
 #define DWDT1 ((uint8_t *)0)
 #define DWDT2 ((uint8_t *)1)
 #define DRBT1  ((uint16_t *)2)
 #define DRBT2  ((uint16_t *)4)
+#define DBGR1 ((uint8_t *)6)
+#define DBGR2 ((uint8_t *)7)
+#define DBOF1 ((uint8_t *)8)
+#define DBOF2 ((uint8_t *)9)
+#define DFLM1 ((uint8_t *)10)
+#define DFLM2 ((uint8_t *)11)
+#define DBCP1  ((uint16_t *)12)
+#define DBCP2  ((uint16_t *)14)
 
-#define BIT_LED 1
+/*
+ * Each value backed-up in EEPROM is stored twice, the second copy inverted,
+ * and reads as 0 if the copies do not match.
+ */
 
-void registers_reset(void)
+static uint8_t registers_load_byte(uint8_t *addr1, uint8_t *addr2)
 {
-    /* get default watchdog delay */
-    uint8_t dwdt1 = eeprom_read_byte(DWDT1);
-    uint8_t dwdt2 = eeprom_read_byte(DWDT2);
+    uint8_t v1 = eeprom_read_byte(addr1);
+    uint8_t v2 = eeprom_read_byte(addr2);
+
+    return ((v1^v2)==0xFF) ? v1 : 0;
+}
+
+static uint16_t registers_load_word(uint16_t *addr1, uint16_t *addr2)
+{
+    uint16_t v1 = eeprom_read_word(addr1);
+    uint16_t v2 = eeprom_read_word(addr2);
+
+    return ((v1^v2)==0xFFFF) ? v1 : 0;
+}
+
+static void registers_save_byte(uint8_t *addr1, uint8_t *addr2, uint8_t v)
+{
+    eeprom_write_byte(addr1, v);
+    eeprom_write_byte(addr2, v^0xFF);
+    COUNTER_INC(EEPROM_WRITES);
+}
+
+static void registers_save_word(uint16_t *addr1, uint16_t *addr2, uint16_t v)
+{
+    eeprom_write_word(addr1, v);
+    eeprom_write_word(addr2, v^0xFFFF);
+    COUNTER_INC(EEPROM_WRITES);
+}
+
+/*
+ * Keep the poll window within the registers, or within the selected page
+ * when it starts at TWI_PAGE_BASE or above, as a read reaching an unmapped
+ * register ends before it wraps. A window starting in between is disabled.
+ */
+static void registers_poll(void)
+{
+    uint8_t start = in_regs.POLL_START;
+    uint8_t length = in_regs.POLL_LENGTH;
+    uint16_t end;
+
+    if (start < sizeof(registers_t))
+        end = sizeof(registers_t);
+    else if (start >= TWI_PAGE_BASE)
+        end = TWI_PAGE_BASE + twi_page_length();
+    else
+        end = start;
+
+    if (start >= end)
+        length = 0;
+    else if (length > end - start)
+        length = end - start;
+
+    // the ISR reads both when a read starts
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        out_regs.POLL_START = start;
+        out_regs.POLL_LENGTH = length;
+    }
+}
 
-    if ((dwdt1^dwdt2)==0xFF)
-        out_regs.DEFAULT_WATCHDOG = dwdt1;
+static void registers_page(uint8_t page)
+{
+    if (page==(REG_PAGE_COUNTERS | REG_PAGE_SNAPSHOT))
+    {
+        counters_take_snapshot();
+    }
     else
-        out_regs.DEFAULT_WATCHDOG = 0;
+    {
+#ifndef TRACE
+        if (page==(REG_PAGE_HEARTBEAT | REG_PAGE_SNAPSHOT))
+            heartbeat_clear();
+#endif
+        page &= ~REG_PAGE_SNAPSHOT;
+    }
+
+#ifdef TRACE
+    // a trace frozen by a failure stays so until it was read
+    if (page==REG_PAGE_TRACE)
+        trace_freeze(1);
+    else if (out_regs.PAGE==REG_PAGE_TRACE)
+        trace_freeze(0);
+#endif
+
+    switch (page) {
+#ifdef TRACE
+        case REG_PAGE_TRACE:
+            twi_set_page((const uint8_t *)&trace, sizeof(trace));
+            break;
+#endif
+        case REG_PAGE_COUNTERS:
+            twi_set_page((const uint8_t *)&counters, sizeof(counters));
+            break;
+        case REG_PAGE_COUNTERS | REG_PAGE_SNAPSHOT:
+            twi_set_page((const uint8_t *)&counters_snapshot, 
+                sizeof(counters_snapshot));
+            break;
+#ifndef TRACE
+        case REG_PAGE_HEARTBEAT:
+            twi_set_page((const uint8_t *)&heartbeat, sizeof(heartbeat));
+            break;
+#endif
+        default:
+            page = REG_PAGE_NONE;
+            twi_set_page(0, 0);
+            break;
+    }
+    out_regs.PAGE = page;
+}
+
+static void registers_slot(uint8_t cmd)
+{
+    schedule_slot_t slot;
+    uint8_t n = cmd % SCHEDULE_SLOTS;
+
+    if (cmd & REG_SLOT_SAVE)
+    {
+        slot.on = out_regs.SLOT_ON;
+        slot.off = out_regs.SLOT_OFF;
+        slot.repeat = out_regs.SLOT_REPEAT;
+        schedule_write_slot(n, &slot);
+        COUNTER_INC(EEPROM_WRITES);
+        schedule_init();
+    }
+    schedule_read_slot(n, &slot);
+
+    out_regs.SLOT_ON = slot.on;
+    out_regs.SLOT_OFF = slot.off;
+    out_regs.SLOT_REPEAT = slot.repeat;
+    out_regs.SLOT = n;
+}
 
+/*
+ * After a watchdog reset (resume), out_regs still holds the registers as
+ * the host set them: in_regs is set up to match rather than both reset.
+ */
+static void registers_resume(void)
+{
+    in_regs.LED         = out_regs.LED;
+    in_regs.LED_ARG     = out_regs.LED_ARG;
+    in_regs.POLL_START  = out_regs.POLL_START;
+    in_regs.POLL_LENGTH = out_regs.POLL_LENGTH;
+    in_regs.PAGE        = REG_PAGE_KEEP;
+
+    registers_page(out_regs.PAGE);
+}
+
+void registers_init(uint8_t resume)
+{
+    if (!resume)
+        memset(&out_regs, 0, sizeof(out_regs));
+
+    /* get default watchdog delay */
+    out_regs.DEFAULT_WATCHDOG = registers_load_byte(DWDT1, DWDT2);
     in_regs.DEFAULT_WATCHDOG = out_regs.DEFAULT_WATCHDOG;
 
     /* get default reboot delay */
-    uint16_t drbt1 = eeprom_read_word(DRBT1);
-    uint16_t drbt2 = eeprom_read_word(DRBT2);
+    out_regs.DEFAULT_REBOOT = registers_load_word(DRBT1, DRBT2);
+    in_regs.DEFAULT_REBOOT = out_regs.DEFAULT_REBOOT;
+
+    /* get default boot grace period */
+    out_regs.DEFAULT_BOOT_GRACE = registers_load_byte(DBGR1, DBGR2);
+    in_regs.DEFAULT_BOOT_GRACE = out_regs.DEFAULT_BOOT_GRACE;
+
+    /* get reboot backoff policy */
+    out_regs.BACKOFF = registers_load_byte(DBOF1, DBOF2);
+    in_regs.BACKOFF = out_regs.BACKOFF;
+    out_regs.BACKOFF_CAP = registers_load_word(DBCP1, DBCP2);
+    in_regs.BACKOFF_CAP = out_regs.BACKOFF_CAP;
+    out_regs.FAIL_LIMIT = registers_load_byte(DFLM1, DFLM2);
+    in_regs.FAIL_LIMIT = out_regs.FAIL_LIMIT;
 
-    if ((drbt1^drbt2)==0xFFFF)
-        out_regs.DEFAULT_REBOOT = drbt1;
+    if (resume)
+        registers_resume();
     else
-        out_regs.DEFAULT_REBOOT = 0;
-    
-    in_regs.DEFAULT_REBOOT = out_regs.DEFAULT_REBOOT;
+        registers_reset();
+}
 
+/* 
+ * Reset registers to their defaults, using the values cached in out_regs 
+ * rather than reading the EEPROM again: registers_sync() keeps them equal.
+ */
+void registers_reset(void)
+{
     out_regs.STATUS     = 0;
     out_regs.WATCHDOG   = out_regs.DEFAULT_WATCHDOG;
     out_regs.REBOOT     = out_regs.DEFAULT_REBOOT;
 
+    out_regs.GRACE      = 0;
+    out_regs.POLL_START = 0;
+    out_regs.POLL_LENGTH = 0;
+
     in_regs.STATUS      = 0;
-    in_regs.WATCHDOG    = out_regs.DEFAULT_WATCHDOG;
-    in_regs.REBOOT      = out_regs.DEFAULT_REBOOT;
+    in_regs.POLL_START  = 0;
+    in_regs.POLL_LENGTH = 0;
+    in_regs.PAGE        = REG_PAGE_KEEP;
+
+    registers_page(REG_PAGE_NONE);
+
+    out_regs.VERSION = 3;
+}
+
+/* 
+ * Execute commands that only affect registers, and return those that 
+ * affect power for the caller to execute, REG_CMD_NONE otherwise.
+ */
+static uint8_t registers_command(uint8_t cmd)
+{
+    out_regs.CMD = REG_CMD_NONE;
 
-    out_regs.VERSION = 2;
+    switch (cmd) {
+        case REG_CMD_KICK: // any write kicks the watchdog
+            break;
+        case REG_CMD_REBOOT:
+            // no off time would turn the reboot into a shutdown
+            if (out_regs.CMD_ARG==0 && out_regs.REBOOT==0)
+            {
+                out_regs.CMD = REG_CMD_REJECTED;
+                break;
+            }
+            return cmd;
+        case REG_CMD_SHUTDOWN:
+            return cmd;
+        case REG_CMD_LED:
+            led_set(out_regs.CMD_ARG & 0xFF, out_regs.CMD_ARG >> 8);
+            break;
+        case REG_CMD_CLEAR:
+            out_regs.STATUS &= ~(out_regs.CMD_ARG);
+            break;
+        case REG_CMD_SAVE:
+            in_regs.DEFAULT_WATCHDOG = out_regs.WATCHDOG;
+            in_regs.DEFAULT_REBOOT = out_regs.REBOOT;
+            break;
+        default:
+            out_regs.CMD = REG_CMD_REJECTED;
+            break;
+    }
+    return REG_CMD_NONE;
 }
 
-void registers_sync(void)
+uint8_t registers_sync(void)
 {
+   uint8_t cmd = REG_CMD_NONE;
+
+   COUNTER_INC(SYNCS);
+
    out_regs.STATUS &= ~(in_regs.STATUS);
    in_regs.STATUS = 0;
-   out_regs.WATCHDOG = in_regs.WATCHDOG;
-   out_regs.REBOOT = in_regs.REBOOT;
 
    if (in_regs.VERSION==0x81)
    {
-        PORTB &= ~(1<<BIT_LED);
+        led_set(LED_MODE_OFF, 0);
         in_regs.VERSION = 0;        
    }
    
    if (in_regs.VERSION==0x82)
    {
-        PORTB |= (1<<BIT_LED);
+        led_set(LED_MODE_ON, 0);
         in_regs.VERSION = 0;        
    }
 
+   if (in_regs.CMD!=REG_CMD_NONE)
+   {
+        cmd = registers_command(in_regs.CMD);
+        in_regs.CMD = REG_CMD_NONE;
+   }
+
+   if (in_regs.SLOT & (REG_SLOT_LOAD | REG_SLOT_SAVE))
+   {
+        registers_slot(in_regs.SLOT);
+        in_regs.SLOT = 0;
+   }
+
+   if (in_regs.PAGE!=REG_PAGE_KEEP)
+   {
+        registers_page(in_regs.PAGE);
+        in_regs.PAGE = REG_PAGE_KEEP;
+   }
+
+   registers_poll();
+
+   ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        if (in_regs.LED!=out_regs.LED || in_regs.LED_ARG!=out_regs.LED_ARG)
+        {
+            led_set(in_regs.LED, in_regs.LED_ARG);
+        }
+   }
+
    if (in_regs.DEFAULT_WATCHDOG!=out_regs.DEFAULT_WATCHDOG)
    {
-        eeprom_write_byte(DWDT1, in_regs.DEFAULT_WATCHDOG);
-        eeprom_write_byte(DWDT2, in_regs.DEFAULT_WATCHDOG^0xFF);
+        registers_save_byte(DWDT1, DWDT2, in_regs.DEFAULT_WATCHDOG);
         out_regs.DEFAULT_WATCHDOG = in_regs.DEFAULT_WATCHDOG;
    }
 
    if (in_regs.DEFAULT_REBOOT!=out_regs.DEFAULT_REBOOT)
    {
-        eeprom_write_word(DRBT1, in_regs.DEFAULT_REBOOT);
-        eeprom_write_word(DRBT2, in_regs.DEFAULT_REBOOT^0xFFFF);
+        registers_save_word(DRBT1, DRBT2, in_regs.DEFAULT_REBOOT);
         out_regs.DEFAULT_REBOOT = in_regs.DEFAULT_REBOOT;
    }
+
+   if (in_regs.DEFAULT_BOOT_GRACE!=out_regs.DEFAULT_BOOT_GRACE)
+   {
+        registers_save_byte(DBGR1, DBGR2, in_regs.DEFAULT_BOOT_GRACE);
+        out_regs.DEFAULT_BOOT_GRACE = in_regs.DEFAULT_BOOT_GRACE;
+   }
+
+   if (in_regs.BACKOFF!=out_regs.BACKOFF)
+   {
+        registers_save_byte(DBOF1, DBOF2, in_regs.BACKOFF);
+        out_regs.BACKOFF = in_regs.BACKOFF;
+   }
+
+   if (in_regs.BACKOFF_CAP!=out_regs.BACKOFF_CAP)
+   {
+        registers_save_word(DBCP1, DBCP2, in_regs.BACKOFF_CAP);
+        out_regs.BACKOFF_CAP = in_regs.BACKOFF_CAP;
+   }
+
+   if (in_regs.FAIL_LIMIT!=out_regs.FAIL_LIMIT)
+   {
+        registers_save_byte(DFLM1, DFLM2, in_regs.FAIL_LIMIT);
+        out_regs.FAIL_LIMIT = in_regs.FAIL_LIMIT;
+   }
+
+   return cmd;
 }
 
 void registers_clear_defaults(void)
 {
+    schedule_slot_t slot = { 0, 0, 0 };
+    uint8_t n;
+
     in_regs.DEFAULT_WATCHDOG = 0;
     in_regs.DEFAULT_REBOOT = 0;
+    in_regs.DEFAULT_BOOT_GRACE = 0;
+    in_regs.BACKOFF = 0;
+    in_regs.BACKOFF_CAP = 0;
+    in_regs.FAIL_LIMIT = 0;
     registers_sync();
+
+    for (n=0; n<SCHEDULE_SLOTS; n++)
+        schedule_write_slot(n, &slot);
+    schedule_init();
 }
 
@@ -10,6 +10,9 @@ typedef struct {
         // bit 7: 1 if button short press, reset by setting 0
         // bit 6: 1 if rebooted from timer
         // bit 5: 1 if rebooted from button
+        // bit 4: 1 if the watchdog expired and power is about to be cut,
+        //        writing 1 while set tells the PiWatcher the host is halted
+        //        and power can be cut immediately
 
     volatile uint8_t WATCHDOG;
         // R+W
@@ -27,7 +30,9 @@ typedef struct {
 
     volatile uint8_t VERSION;
         // R only
-        // Current firmware version
+        // Current firmware version, i.e. register map:
+        // 2: registers up to DEFAULT_REBOOT only
+        // 3: GRACE to POLL_LENGTH, diagnostic pages at 0x40
 
     volatile uint8_t DEFAULT_WATCHDOG;
         // R+W, backed-up in EEPROM
@@ -39,18 +44,221 @@ typedef struct {
         // This value will be copied into REBOOT at boot time;
         // See REBOOT register.
 
+    volatile uint8_t GRACE;
+        // R+W
+        // if 0, power is cut as soon as the watchdog expires
+        // else number of seconds the host is given to halt once bit 4 of
+        // STATUS is raised. Power is cut earlier if the host acknowledges
+        // bit 4 or stays silent on the bus for 2 seconds.
+
+    volatile uint8_t LED;
+        // R+W
+        // LED pattern:
+        // 0: off
+        // 1: on
+        // 2: constant level, LED_ARG is the duty cycle (0-255)
+        // 3: breathing, LED_ARG is the brightness step per tick
+        // 4: blink code, LED_ARG blinks followed by a pause
+        // 5: flashing, LED_ARG is the number of ticks between toggles
+        // The PiWatcher overrides the pattern on power state changes.
+
+    volatile uint8_t LED_ARG;
+        // R+W
+        // Argument of the LED pattern, see LED register.
+
+    volatile uint8_t PAGE;
+        // R+W
+        // Selects the read-only diagnostic page mapped at register 0x40:
+        // 0: none
+        // 1: reserved
+        // 2: ISR trace, see trace_t (only if built with TRACE defined),
+        //    recording stops at the first bus recovery and while this
+        //    page is selected
+        // 3: performance counters, see counters_t
+        // 4: heartbeat interval histogram, see heartbeat_t (not if
+        //    built with TRACE defined)
+        // Writing 0x83 copies the counters and clears them in one step,
+        // and shows the copy until another page is written (PAGE reads 
+        // 0x83): write 0x83 again for the next one. A TRACE build has no
+        // copy, 0x83 clears the counters and shows them. Writing 0x84 
+        // clears the heartbeat histogram and shows it. Writing 0xFF does
+        // nothing.
+
+    volatile uint16_t SLOT_ON;
+        // R+W, backed-up in EEPROM
+        // Power schedule slot: (number of ticks * 50) the Pi stays on.
+
+    volatile uint16_t SLOT_OFF;
+        // R+W, backed-up in EEPROM
+        // Power schedule slot: (number of ticks * 50) the Pi stays off
+        // after the on period, 0 to shut down until the button is pressed.
+
+    volatile uint8_t SLOT_REPEAT;
+        // R+W, backed-up in EEPROM
+        // Power schedule slot: number of on/off cycles before moving to
+        // the next slot, 0 if the slot is unused, 255 to repeat forever.
+
+    volatile uint8_t SLOT;
+        // R+W
+        // Power schedule slot number (0-3) shown in SLOT_ON, SLOT_OFF and 
+        // SLOT_REPEAT. Write with bit 6 set to load that slot from EEPROM,
+        // or with bit 7 set to save SLOT_ON, SLOT_OFF and SLOT_REPEAT into
+        // it, so a slot can be saved in the same transaction as its fields.
+
+    volatile uint8_t SCHEDULE;
+        // R only
+        // Power schedule slot being executed, 255 if the schedule is empty.
+        // The schedule restarts from its first slot after a button wake.
+
+    volatile uint16_t SCHEDULE_REMAINING;
+        // R only
+        // (number of ticks * 50) left in the current schedule on/off period.
+
+    volatile uint8_t BUS_RECOVERIES;
+        // R only
+        // Number of times the I2C interface was reset after the bus hung.
+
+    volatile uint8_t DEFAULT_BOOT_GRACE;
+        // R+W, backed-up in EEPROM
+        // if 0, WATCHDOG applies as soon as the Pi is powered on
+        // else number of seconds the Pi is given to boot: this replaces 
+        // WATCHDOG after each power on, until the host first writes to a
+        // register.
+
+    volatile uint16_t BOOT_TIME;
+        // R only
+        // number of ticks between the last power on and the first write
+        // from the host, saturating at 0xFFFF, 0 if the host has not written 
+        // anything yet.
+
+    volatile uint8_t BACKOFF;
+        // R+W, backed-up in EEPROM
+        // if 0 or 1, REBOOT is used after every watchdog expiry
+        // else REBOOT is multiplied by BACKOFF for each consecutive watchdog
+        // expiry after the first one, see FAILURES
+
+    volatile uint16_t BACKOFF_CAP;
+        // R+W, backed-up in EEPROM
+        // if 0, no limit
+        // else maximum (number of ticks * 2) reached by the backoff
+
+    volatile uint8_t FAIL_LIMIT;
+        // R+W, backed-up in EEPROM
+        // if 0, keep rebooting
+        // else shut down instead of rebooting once FAILURES reaches this
+        // value, until the button is pressed
+
+    volatile uint8_t FAILURES;
+        // R only
+        // number of consecutive watchdog expiries, reset to 0 by the first
+        // write from the host after a power on (see BOOT_TIME) or by a
+        // button wake.
+
+    volatile uint16_t CMD_ARG;
+        // R+W
+        // Argument of the next command, see CMD.
+
+    volatile uint8_t CMD;
+        // W: command opcode, executed as soon as it is written, so CMD_ARG
+        // and CMD can be sent in a single transaction:
+        // 0x01: kick the watchdog
+        // 0x02: shut down now, until the button is pressed
+        // 0x03: power off now for (CMD_ARG * 2) seconds, or REBOOT if 0,
+        //       rejected if both are 0
+        // 0x04: set LED to CMD_ARG & 0xFF, LED_ARG to CMD_ARG >> 8
+        // 0x05: clear STATUS bits set in CMD_ARG
+        // 0x06: save WATCHDOG and REBOOT as DEFAULT_WATCHDOG and 
+        //       DEFAULT_REBOOT
+        // R: 0 if the last command was accepted, 0xFF if it was rejected
+
+    volatile uint8_t RESET_CAUSE;
+        // R only
+        // Cause of the last reset of the PiWatcher itself:
+        // 0x01: power-on
+        // 0x02: external reset
+        // 0x04: brown-out
+        // 0x08: watchdog, the Pi was kept in its power state: a reboot
+        //       wait goes on for the rest of its off time, a running Pi
+        //       keeps its registers (a pending power cut is dropped)
+
+    volatile uint8_t POLL_START;
+        // R+W
+        // First register of the poll window.
+
+    volatile uint8_t POLL_LENGTH;
+        // R+W
+        // Number of registers in the poll window, 0 to disable it. A read 
+        // not preceded by a register write since the last read starts at 
+        // POLL_START and wraps around within the window, so the host can 
+        // poll with a single read transaction. May include the page at 0x40.
+        // Clamped to the end of the registers, or of the selected page for
+        // a window starting at 0x40 or above, 0 for a window starting in 
+        // between.
+
 } __attribute__ ((__packed__)) registers_t;
 
+/*
+ * Host writes to the registers above, applied by registers_sync(). Only 
+ * the registers that take effect through registers_sync() have a copy 
+ * here, in the same order. WATCHDOG, REBOOT, GRACE, SLOT_ON, SLOT_OFF, 
+ * SLOT_REPEAT and CMD_ARG are plain values written in place in out_regs,
+ * writes to read-only registers are dropped.
+ */
+typedef struct {
+    volatile uint8_t STATUS;
+    volatile uint8_t VERSION;
+    volatile uint8_t DEFAULT_WATCHDOG;
+    volatile uint16_t DEFAULT_REBOOT;
+    volatile uint8_t LED;
+    volatile uint8_t LED_ARG;
+    volatile uint8_t PAGE;
+    volatile uint8_t SLOT;
+    volatile uint8_t DEFAULT_BOOT_GRACE;
+    volatile uint8_t BACKOFF;
+    volatile uint16_t BACKOFF_CAP;
+    volatile uint8_t FAIL_LIMIT;
+    volatile uint8_t CMD;
+    volatile uint8_t POLL_START;
+    volatile uint8_t POLL_LENGTH;
+} __attribute__ ((__packed__)) registers_in_t;
+
 extern registers_t out_regs;
-extern registers_t in_regs;
+extern registers_in_t in_regs;
 
 #define REG_STATUS_BUTTON       0x80
 #define REG_STATUS_BOOT_TIMER   0x40
 #define REG_STATUS_BOOT_BUTTON  0x20
+#define REG_STATUS_SHUTDOWN     0x10
+
+#define REG_RESET_POWER_ON      0x01
+#define REG_RESET_EXTERNAL      0x02
+#define REG_RESET_BROWN_OUT     0x04
+#define REG_RESET_WATCHDOG      0x08
+
+#define REG_CMD_NONE            0x00
+#define REG_CMD_KICK            0x01
+#define REG_CMD_SHUTDOWN        0x02
+#define REG_CMD_REBOOT          0x03
+#define REG_CMD_LED             0x04
+#define REG_CMD_CLEAR           0x05
+#define REG_CMD_SAVE            0x06
+#define REG_CMD_REJECTED        0xFF
+
+#define REG_SLOT_LOAD           0x40
+#define REG_SLOT_SAVE           0x80
+
+#define REG_PAGE_NONE           0
+#define REG_PAGE_TRACE          2
+#define REG_PAGE_COUNTERS       3
+#define REG_PAGE_HEARTBEAT      4
+#define REG_PAGE_SNAPSHOT       0x80
+#define REG_PAGE_KEEP           0xFF    // in in_regs: no page written
+
+void registers_init(uint8_t resume);
 
 void registers_reset(void);
 
-void registers_sync(void);
+uint8_t registers_sync(void);
 
 void registers_clear_defaults(void);
 
@@ -0,0 +1,162 @@
+#include <avr/eeprom.h>
+#include "schedule.h"
+#include "registers.h"
+#include "timer.h"
+#include "deadline.h"
+
+/*
+ * Power schedule table.
+ *
+ * Each slot describes <repeat> cycles of <on> time followed by <off> time.
+ * Slots are executed in order, skipping unused ones, and the table wraps 
+ * around once the last slot is done. Slots are stored in EEPROM after the
+ * default registers, each followed by a check byte.
+ */
+
+#define SCHEDULE_EEPROM     ((uint8_t *)0x10)
+#define SCHEDULE_STRIDE     (sizeof(schedule_slot_t)+1)
+
+#define PHASE_ON    0
+#define PHASE_OFF   1
+
+static uint8_t sched_slot = SCHEDULE_NONE;
+static uint8_t sched_left;
+static uint8_t sched_phase;
+static uint32_t sched_deadline;
+
+static uint8_t schedule_check(const schedule_slot_t *slot)
+{
+    const uint8_t *p = (const uint8_t *)slot;
+    uint8_t check = 0xFF;
+    uint8_t i;
+
+    for (i=0; i<sizeof(schedule_slot_t); i++)
+        check ^= p[i];
+    return check;
+}
+
+void schedule_read_slot(uint8_t n, schedule_slot_t *slot)
+{
+    uint8_t *addr = SCHEDULE_EEPROM + n*SCHEDULE_STRIDE;
+
+    eeprom_read_block(slot, addr, sizeof(schedule_slot_t));
+    if (eeprom_read_byte(addr + sizeof(schedule_slot_t))!=schedule_check(slot))
+        slot->repeat = 0;
+}
+
+void schedule_write_slot(uint8_t n, const schedule_slot_t *slot)
+{
+    uint8_t *addr = SCHEDULE_EEPROM + n*SCHEDULE_STRIDE;
+
+    eeprom_update_block(slot, addr, sizeof(schedule_slot_t));
+    eeprom_update_byte(addr + sizeof(schedule_slot_t), schedule_check(slot));
+}
+
+static void schedule_start_on(uint32_t now)
+{
+    schedule_slot_t slot;
+
+    schedule_read_slot(sched_slot, &slot);
+    sched_phase = PHASE_ON;
+    sched_deadline = now + (uint32_t)slot.on*50;
+    deadline_set(DEADLINE_SCHEDULE, sched_deadline);
+}
+
+// find the next used slot after <from>, wrapping around the table
+static uint8_t schedule_next(uint8_t from)
+{
+    schedule_slot_t slot;
+    uint8_t i;
+
+    for (i=1; i<=SCHEDULE_SLOTS; i++)
+    {
+        schedule_read_slot((from+i)%SCHEDULE_SLOTS, &slot);
+        if (slot.repeat!=0)
+        {
+            sched_left = slot.repeat;
+            return (from+i)%SCHEDULE_SLOTS;
+        }
+    }
+    return SCHEDULE_NONE;
+}
+
+// (re)start the table from its first used slot
+void schedule_init(void)
+{
+    sched_slot = schedule_next(SCHEDULE_SLOTS-1);
+    if (sched_slot!=SCHEDULE_NONE)
+        schedule_start_on(timer_ticks());
+    else
+        deadline_cancel(DEADLINE_SCHEDULE);
+}
+
+void schedule_power_on(uint32_t now)
+{
+    if (sched_slot==SCHEDULE_NONE)
+        return;
+
+    if (sched_phase==PHASE_ON)
+    {
+        if ((int32_t)(sched_deadline-now)>0)
+        {
+            deadline_set(DEADLINE_SCHEDULE, sched_deadline);
+            return;
+        }
+        // the on period ended while the Pi was off and it was powered on
+        // by hand: go on with the next one
+        sched_phase = PHASE_OFF;
+    }
+
+    if (sched_left!=SCHEDULE_FOREVER && --sched_left==0)
+        sched_slot = schedule_next(sched_slot);
+    
+    if (sched_slot!=SCHEDULE_NONE)
+        schedule_start_on(now);
+}
+
+uint32_t schedule_power_off(uint32_t now)
+{
+    schedule_slot_t slot;
+    uint32_t wait;
+
+    schedule_read_slot(sched_slot, &slot);
+    wait = (uint32_t)slot.off*50;
+    sched_phase = PHASE_OFF;
+    sched_deadline = now + wait;
+    return wait;
+}
+
+/*
+ * The on period may end while the Pi is off, e.g. waiting for a reboot. 
+ * Its off phase then started when it ended: returns the off time left, 
+ * SCHEDULE_SHUTDOWN if that phase is a shutdown, 0 if the Pi is due on.
+ */
+uint32_t schedule_missed(uint32_t now)
+{
+    if (sched_slot==SCHEDULE_NONE || sched_phase!=PHASE_ON || 
+        (int32_t)(sched_deadline-now)>0)
+        return 0;
+
+    if (schedule_power_off(sched_deadline)==0)
+        return SCHEDULE_SHUTDOWN;
+    if ((int32_t)(sched_deadline-now)<=0)
+        return 0;
+    return sched_deadline-now;
+}
+
+// called once per main loop iteration, the remaining time only changes 
+// every 2 seconds and is refreshed once per second
+void schedule_update(uint32_t now)
+{
+    static uint8_t second;
+
+    out_regs.SCHEDULE = sched_slot;
+    if ((uint8_t)(now-second)<25)
+        return;
+    second = now;
+
+    if (sched_slot!=SCHEDULE_NONE && (int32_t)(sched_deadline-now)>0)
+        out_regs.SCHEDULE_REMAINING = (sched_deadline-now)/50;
+    else
+        out_regs.SCHEDULE_REMAINING = 0;
+}
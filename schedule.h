@@ -0,0 +1,31 @@
+#ifndef _SCHEDULE_H_
+#define _SCHEDULE_H_
+
+#include <stdint.h>
+
+#define SCHEDULE_SLOTS      4
+#define SCHEDULE_NONE       0xFF
+#define SCHEDULE_FOREVER    0xFF
+#define SCHEDULE_SHUTDOWN   0xFFFFFFFF
+
+typedef struct {
+    uint16_t on;        // number of ticks * 50 the Pi stays powered
+    uint16_t off;       // number of ticks * 50 the Pi stays off, 0 to shut down
+    uint8_t repeat;     // number of on/off cycles, 0 if unused, 255 forever
+} __attribute__ ((__packed__)) schedule_slot_t;
+
+void schedule_read_slot(uint8_t n, schedule_slot_t *slot);
+
+void schedule_write_slot(uint8_t n, const schedule_slot_t *slot);
+
+void schedule_init(void);
+
+void schedule_power_on(uint32_t now);
+
+uint32_t schedule_power_off(uint32_t now);
+
+uint32_t schedule_missed(uint32_t now);
+
+void schedule_update(uint32_t now);
+
+#endif
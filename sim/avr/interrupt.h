@@ -0,0 +1,11 @@
+#ifndef _SIM_AVR_INTERRUPT_H_
+#define _SIM_AVR_INTERRUPT_H_
+
+#include <avr/io.h>
+
+#define ISR(vector) void vector(void)
+
+void sei(void);
+void cli(void);
+
+#endif
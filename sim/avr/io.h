@@ -0,0 +1,135 @@
+/*
+ * Host stand-in for <avr/io.h>: the ATtiny45 I/O registers used by the
+ * firmware are plain variables, defined in io.c and driven by the models.
+ */
+#ifndef _SIM_AVR_IO_H_
+#define _SIM_AVR_IO_H_
+
+#include <stdint.h>
+
+#define SIM_REG(n) extern volatile uint8_t n;
+
+SIM_REG(PINB) SIM_REG(DDRB) SIM_REG(PORTB)
+SIM_REG(USICR) SIM_REG(USISR) SIM_REG(USIDR)
+SIM_REG(TCCR1) SIM_REG(TCNT1) SIM_REG(OCR1A) SIM_REG(OCR1B) SIM_REG(OCR1C)
+SIM_REG(TCCR0A) SIM_REG(TCCR0B) SIM_REG(TCNT0) SIM_REG(OCR0A) SIM_REG(OCR0B)
+SIM_REG(TIMSK) SIM_REG(TIFR) SIM_REG(GTCCR)
+SIM_REG(GIMSK) SIM_REG(PCMSK)
+SIM_REG(ACSR) SIM_REG(PRR) SIM_REG(MCUCR) SIM_REG(MCUSR) SIM_REG(WDTCR)
+SIM_REG(DIDR0) SIM_REG(ADMUX) SIM_REG(ADCSRA) SIM_REG(EECR)
+extern volatile uint16_t ADC;
+
+// interrupt vectors, ISR() defines them as plain functions
+void USI_START_vect(void);
+void USI_OVF_vect(void);
+void TIMER1_COMPA_vect(void);
+void PCINT0_vect(void);
+
+#define PB0 0
+#define PB1 1
+#define PB2 2
+#define PB3 3
+#define PB4 4
+#define PB5 5
+#define PINB0 0
+#define PINB1 1
+#define PINB2 2
+#define PINB3 3
+#define PINB4 4
+#define PINB5 5
+
+// USICR
+#define USISIE 7
+#define USIOIE 6
+#define USIWM1 5
+#define USIWM0 4
+#define USICS1 3
+#define USICS0 2
+#define USICLK 1
+#define USITC 0
+
+// USISR
+#define USISIF 7
+#define USIOIF 6
+#define USIPF 5
+#define USIDC 4
+#define USICNT0 0
+
+// TCCR1
+#define CTC1 7
+#define PWM1A 6
+#define COM1A1 5
+#define COM1A0 4
+#define CS13 3
+#define CS12 2
+#define CS11 1
+#define CS10 0
+
+// TIMSK, TIFR
+#define OCIE1A 6
+#define OCIE1B 5
+#define OCIE0A 4
+#define OCIE0B 3
+#define TOIE1 2
+#define TOIE0 1
+#define OCF1A 6
+#define OCF1B 5
+#define TOV1 2
+
+// TCCR0A, TCCR0B
+#define COM0A1 7
+#define COM0A0 6
+#define COM0B1 5
+#define COM0B0 4
+#define WGM01 1
+#define WGM00 0
+#define WGM02 3
+#define CS02 2
+#define CS01 1
+#define CS00 0
+
+// GIMSK, PCMSK
+#define PCIE 5
+#define PCINT4 4
+
+// ACSR, PRR, MCUCR
+#define ACD 7
+#define PRTIM1 3
+#define PRTIM0 2
+#define PRUSI 1
+#define PRADC 0
+#define BODS 7
+#define BODSE 2
+#define SE 5
+#define SM1 4
+#define SM0 3
+
+// MCUSR, WDTCR
+#define WDRF 3
+#define BORF 2
+#define EXTRF 1
+#define PORF 0
+#define WDIF 7
+#define WDIE 6
+#define WDCE 4
+#define WDE 3
+
+// DIDR0, ADMUX, ADCSRA
+#define ADC0D 5
+#define ADC2D 4
+#define ADC3D 3
+#define ADC1D 2
+#define AIN1D 1
+#define AIN0D 0
+#define REFS1 7
+#define REFS0 6
+#define ADEN 7
+#define ADSC 6
+#define ADIF 4
+#define ADPS2 2
+#define ADPS1 1
+#define ADPS0 0
+
+#define E2END 255
+
+#endif
@@ -0,0 +1,539 @@
+/*
+ * Energy profile of the firmware over scripted 24 hour scenarios.
+ *
+ * The firmware sources run unmodified on the host, with energy_sleep() and
+ * energy_power_down() replaced by the scheduler below: the MCU sleeps until
+ * the next Timer1 compare match, host I2C transaction or button edge, and
+ * the time until then is counted in that sleep mode. Timer1, the USI (see
+ * usi.c), the EEPROM and the watchdog are modelled, the Pi is a host that
+ * boots when DRIVE is on, configures the watchdog and polls STATUS.
+ *
+ * Active time is an estimate, hence the _est keys: the host cycles spent in
+ * each main loop iteration and each ISR are measured and scaled by 
+ * AVR_PER_HOST_CYCLE, plus CYCLES_EEPROM per EEPROM write. A change that 
+ * makes the firmware more expensive then shows in the figures, in its host
+ * cost rather than its exact AVR cost: e.g. a 32 bit divide costs about 
+ * 600 cycles on the AVR but a few tens on the host. The measured averages
+ * are reported with the estimate. Supply currents are typical datasheet 
+ * values at 5V and 8MHz.
+ *
+ * Each scenario also reports how long its last power restore took, from
+ * its trigger to DRIVE on, in ticks measured at the pin (drive_on_ticks),
+ * next to the firmware's own RESTORE_TIME counter. The paths are:
+ * cold_boot (the reset, in every scenario until the first power cycle),
+ * timer_reboot (the end of the off time: reboot, watchdog), button_wake
+ * (the press that wakes the MCU from power down: shutdown) and 
+ * button_reboot (a press during the off time: button_reboot).
+ *
+ * Each scenario runs in its own process, for fresh firmware statics, and
+ * prints one JSON object per line.
+ */
+
+#include <setjmp.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <avr/io.h>
+#include <avr/eeprom.h>
+#include <avr/sleep.h>
+#include <avr/wdt.h>
+
+#include "usi.h"
+#include "../registers.h"
+#include "../counters.h"
+#include "../energy.h"
+
+// the AVR runs 8 bit instructions at about 1 per cycle, where the host 
+// runs several 32 or 64 bit instructions per cycle
+#ifndef AVR_PER_HOST_CYCLE
+#define AVR_PER_HOST_CYCLE  8
+#endif
+#ifndef CYCLES_EEPROM
+#define CYCLES_EEPROM   27200   // 3.4ms
+#endif
+
+#ifndef UA_ACTIVE
+#define UA_ACTIVE       4400.0
+#endif
+#ifndef UA_IDLE
+#define UA_IDLE         1200.0
+#endif
+#ifndef UA_POWER_DOWN
+#define UA_POWER_DOWN   0.2
+#endif
+
+#define CPU_HZ          8000000ULL
+#define SECONDS(s)      ((uint64_t)(s)*CPU_HZ)
+#define TIMER1_PRESCALE 8192
+#define TICK            (TIMER1_PRESCALE*39)
+
+#define SLAVE_ADDRESS   0x62
+
+#define HOST_BOOT_S     30      // from DRIVE on to the first I2C access
+#define HOST_WATCHDOG   60      // seconds, written to WATCHDOG at boot
+#define HOST_REBOOT     30      // 2 seconds units, written to REBOOT at boot
+
+#define MODE_ACTIVE     0
+#define MODE_IDLE       1
+#define MODE_POWER_DOWN 2
+
+int firmware_main(void);
+void reset_init(void);
+
+typedef struct {
+    const char *name;
+    uint32_t poll_s;            // host poll period
+    uint32_t hang_s;            // host stops polling, 0 for never
+    uint32_t command_s;         // host writes command, 0 for none
+    uint8_t command;
+    uint16_t command_arg;
+    uint32_t button_s;          // button pressed for 1s, 0 for never
+} scenario_t;
+
+static const scenario_t scenarios[] = {
+    { "heartbeat",  10, 0,    0,    0,                 0,    0 },
+    { "watchdog",   10, 3600, 0,    0,                 0,    0 },
+    { "reboot",     10, 0,    3600, REG_CMD_REBOOT,    1800, 0 },
+    { "shutdown",   10, 0,    3600, REG_CMD_SHUTDOWN,  0,    43200 },
+    { "button_reboot", 10, 0, 3600, REG_CMD_REBOOT,    1800, 5400 },
+};
+
+static const scenario_t *sc;
+static jmp_buf sim_end;
+static uint64_t now;
+static uint64_t end;
+static uint64_t residency[3];
+
+static uint32_t loops;
+static uint64_t loop_host_cycles;
+static uint64_t loop_start;
+static uint32_t interrupts;
+static uint32_t eeprom_writes;
+static uint32_t wdt_resets;
+static uint32_t power_cycles;
+
+static uint64_t last_tick;
+static const char *restore_path;
+static uint64_t restore_trigger;
+static double drive_on_ticks;
+
+/*
+ * EEPROM
+ */
+
+static uint8_t eeprom[E2END+1];
+
+uint8_t eeprom_read_byte(const uint8_t *p)
+{
+    return eeprom[(uintptr_t)p & E2END];
+}
+
+uint16_t eeprom_read_word(const uint16_t *p)
+{
+    return eeprom_read_byte((const uint8_t *)p) |
+        (eeprom_read_byte((const uint8_t *)p + 1)<<8);
+}
+
+void eeprom_read_block(void *dst, const void *src, size_t n)
+{
+    size_t i;
+
+    for (i=0; i<n; i++)
+        ((uint8_t *)dst)[i] = eeprom_read_byte((const uint8_t *)src + i);
+}
+
+void eeprom_write_byte(uint8_t *p, uint8_t value)
+{
+    eeprom[(uintptr_t)p & E2END] = value;
+    eeprom_writes++;
+}
+
+void eeprom_write_word(uint16_t *p, uint16_t value)
+{
+    eeprom_write_byte((uint8_t *)p, value);
+    eeprom_write_byte((uint8_t *)p + 1, value>>8);
+}
+
+void eeprom_update_byte(uint8_t *p, uint8_t value)
+{
+    if (eeprom_read_byte(p)!=value)
+        eeprom_write_byte(p, value);
+}
+
+void eeprom_update_block(const void *src, void *dst, size_t n)
+{
+    size_t i;
+
+    for (i=0; i<n; i++)
+        eeprom_update_byte((uint8_t *)dst + i, ((const uint8_t *)src)[i]);
+}
+
+/*
+ * Watchdog: a timeout is counted as a reset, the simulation goes on
+ */
+
+static uint8_t wdt_on;
+static uint64_t wdt_deadline;
+static uint64_t wdt_period;
+
+void wdt_enable(uint8_t timeout)
+{
+    wdt_on = 1;
+    wdt_period = (CPU_HZ/64) << timeout;    // 16ms << WDTO_xx
+    wdt_deadline = now + wdt_period;
+}
+
+void wdt_disable(void)
+{
+    wdt_on = 0;
+}
+
+void wdt_reset(void)
+{
+    wdt_deadline = now + wdt_period;
+}
+
+void set_sleep_mode(uint8_t mode)
+{
+}
+
+/*
+ * Timer1, free running with prescaler 8192, flags in TIFR are cleared by
+ * writing 1: bit 0 is unused and reads back as 1 until the firmware wrote.
+ */
+
+static uint8_t t1_flags;
+static uint8_t t1_running;
+static uint64_t t1_next;
+
+static void sim_sync(void)
+{
+    uint8_t running = (TCCR1 & 0x0F) && !(PRR & (1<<PRTIM1));
+
+    if (running && !t1_running)
+        t1_next = now + TIMER1_PRESCALE;
+    t1_running = running;
+    if (!(TIFR & 1))
+        t1_flags &= ~TIFR;
+    TIFR = t1_flags | 1;
+    usi_commit();
+}
+
+// advance the simulated time, counting it in the given mode
+static void sim_advance(uint64_t until, uint8_t mode)
+{
+    if (until>end)
+        until = end;
+    residency[mode] += until-now;
+
+    while (t1_running && t1_next<=until)
+    {
+        TCNT1++;
+        if (TCNT1==0)
+            t1_flags |= (1<<TOV1);
+        if (TCNT1==OCR1A)
+            t1_flags |= (1<<OCF1A);
+        t1_next += TIMER1_PRESCALE;
+    }
+    now = until;
+    TIFR = t1_flags | 1;
+
+    if (wdt_on && now>wdt_deadline)
+    {
+        wdt_resets++;
+        wdt_deadline = now + wdt_period;
+    }
+    if (now>=end)
+        longjmp(sim_end, 1);
+}
+
+// time of the next compare match, or never
+static uint64_t timer_next_compare(void)
+{
+    uint8_t n = OCR1A - TCNT1;
+
+    if (!t1_running || !(TIMSK & (1<<OCIE1A)))
+        return UINT64_MAX;
+    return t1_next + (uint64_t)((n ? n : 256) - 1)*TIMER1_PRESCALE;
+}
+
+static void sim_interrupt(void (*vector)(void))
+{
+    if (vector==TIMER1_COMPA_vect)
+        last_tick = now;
+    interrupts++;
+    usi_run(vector);
+    sim_sync();
+}
+
+/*
+ * Host: boots when DRIVE is switched on, then polls STATUS
+ */
+
+#define HOST_OFF        0
+#define HOST_BOOTING    1
+#define HOST_RUNNING    2
+#define HOST_HUNG       3
+
+static uint8_t host_state;
+static uint64_t host_next;
+static uint8_t host_commanded;
+static uint8_t host_hung;
+
+static uint8_t pi_powered(void)
+{
+    return (DDRB & (1<<PB3)) && !(PORTB & (1<<PB3));
+}
+
+static void host_write(const uint8_t *data, uint8_t n)
+{
+    uint8_t i;
+
+    usi_start(USI_START_OK);
+    usi_write(SLAVE_ADDRESS<<1);
+    for (i=0; i<n; i++)
+        usi_write(data[i]);
+    usi_stop();
+}
+
+static void host_poll(void)
+{
+    uint8_t status;
+
+    usi_start(USI_START_OK);
+    usi_write(SLAVE_ADDRESS<<1);
+    usi_write(offsetof(registers_t, STATUS));
+    usi_start(USI_START_OK);
+    usi_write((SLAVE_ADDRESS<<1) | 1);
+    usi_read(&status, 1);
+    usi_stop();
+}
+
+// DRIVE just went off: when the firmware is due to switch it back on, 
+// counting the off time in ticks from the one it went off in
+static void host_power_off(void)
+{
+    uint16_t off = 0;
+
+    if (host_commanded && sc->command==REG_CMD_REBOOT)
+        off = sc->command_arg ? sc->command_arg : HOST_REBOOT;
+    else if (host_hung)
+        off = HOST_REBOOT;
+
+    restore_path = "timer_reboot";
+    restore_trigger = off ? last_tick + (uint64_t)off*50*TICK : UINT64_MAX;
+}
+
+static void host_update(void)
+{
+    if (!pi_powered())
+    {
+        if (host_state!=HOST_OFF)
+            host_power_off();
+        host_state = HOST_OFF;
+        return;
+    }
+    if (host_state==HOST_OFF)
+    {
+        power_cycles++;
+        drive_on_ticks = (double)(now-restore_trigger)/TICK;
+        host_state = HOST_BOOTING;
+        host_next = now + SECONDS(HOST_BOOT_S);
+    }
+}
+
+static void host_event(void)
+{
+    uint8_t config[] = { offsetof(registers_t, WATCHDOG), HOST_WATCHDOG,
+        HOST_REBOOT & 0xFF, HOST_REBOOT>>8 };
+    uint8_t command[] = { offsetof(registers_t, CMD_ARG),
+        sc->command_arg & 0xFF, sc->command_arg>>8, sc->command };
+
+    if (host_state==HOST_BOOTING)
+    {
+        host_write(config, sizeof(config));
+        host_state = HOST_RUNNING;
+    }
+    else if (sc->hang_s && now>=SECONDS(sc->hang_s) && !host_hung)
+    {
+        host_hung = 1;
+        host_state = HOST_HUNG;
+        host_next = UINT64_MAX;
+        return;
+    }
+    else if (sc->command_s && now>=SECONDS(sc->command_s) && !host_commanded)
+    {
+        host_write(command, sizeof(command));
+        host_commanded = 1;
+    }
+    else
+    {
+        host_poll();
+    }
+    host_next = now + SECONDS(sc->poll_s);
+}
+
+/*
+ * Button on PB4, low when pressed, wakes the MCU from power-down through
+ * PCINT4 when enabled
+ */
+
+static uint64_t button_next(void)
+{
+    if (!sc->button_s)
+        return UINT64_MAX;
+    if (PINB & (1<<PB4))
+        return now<=SECONDS(sc->button_s) ? SECONDS(sc->button_s) : UINT64_MAX;
+    return SECONDS(sc->button_s + 1);
+}
+
+static uint8_t button_event(uint8_t mode)
+{
+    PINB ^= (1<<PB4);
+    if (!(PINB & (1<<PB4)) && host_state==HOST_OFF)
+    {
+        restore_path = mode==MODE_POWER_DOWN ? "button_wake" : "button_reboot";
+        restore_trigger = now;
+    }
+    if ((GIMSK & (1<<PCIE)) && (PCMSK & (1<<PCINT4)))
+    {
+        sim_interrupt(PCINT0_vect);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Sleep until the next event that wakes the MCU, then run its interrupt
+ */
+
+static void sim_sleep(uint8_t mode)
+{
+    static uint64_t last_isr_cycles;
+    static uint32_t last_writes;
+    uint64_t next, t;
+
+    t = host_cycles_since(loop_start);
+    loop_host_cycles += t;
+    sim_sync();
+    loops++;
+    sim_advance(now + (t + usi_host_cycles-last_isr_cycles)*AVR_PER_HOST_CYCLE +
+        (eeprom_writes-last_writes)*CYCLES_EEPROM, MODE_ACTIVE);
+
+    for (;;)
+    {
+        host_update();
+
+        if ((t1_flags & (1<<OCF1A)) && (TIMSK & (1<<OCIE1A)) && mode!=MODE_POWER_DOWN)
+        {
+            t1_flags &= ~(1<<OCF1A);
+            sim_interrupt(TIMER1_COMPA_vect);
+            break;
+        }
+
+        next = button_next();
+        if (mode!=MODE_POWER_DOWN)
+        {
+            t = timer_next_compare();
+            if (t<next)
+                next = t;
+            if (host_state!=HOST_OFF && host_next<next)
+                next = host_next;
+        }
+        sim_advance(next, mode);
+
+        if (now==button_next())
+        {
+            if (button_event(mode))
+                break;
+        }
+        else if (mode!=MODE_POWER_DOWN && host_state!=HOST_OFF && now==host_next)
+        {
+            host_event();
+            interrupts += usi_interrupts();
+            break;
+        }
+    }
+    last_isr_cycles = usi_host_cycles;
+    last_writes = eeprom_writes;
+    loop_start = __rdtsc();
+}
+
+void energy_sleep(void)
+{
+    sim_sleep(MODE_IDLE);
+}
+
+void energy_power_down(void)
+{
+    sim_sleep(MODE_POWER_DOWN);
+}
+
+static void run(const scenario_t *s)
+{
+    double seconds[3], uah;
+    uint8_t i;
+
+    sc = s;
+    end = SECONDS(86400);
+    memset(eeprom, 0xFF, sizeof(eeprom));
+    usi_reset();
+    PINB = (1<<PB4) | (1<<PB0) | (1<<PB2);
+    MCUSR = (1<<PORF);
+    restore_path = "cold_boot";
+    restore_trigger = 0;
+
+    if (!setjmp(sim_end))
+    {
+        loop_start = __rdtsc();
+        reset_init();
+        // DRIVE is set from .init3, before main()
+        host_update();
+        firmware_main();
+    }
+
+    for (i=0; i<3; i++)
+        seconds[i] = (double)residency[i] / CPU_HZ;
+    uah = (seconds[MODE_ACTIVE]*UA_ACTIVE + seconds[MODE_IDLE]*UA_IDLE +
+        seconds[MODE_POWER_DOWN]*UA_POWER_DOWN) / 3600;
+
+    printf("{\"scenario\":\"%s\",\"seconds\":%.0f,\"active_s_est\":%.3f,"
+        "\"idle_s_est\":%.3f,\"power_down_s\":%.3f,\"uAh_est\":%.1f,"
+        "\"loops\":%u,\"loop_host_cycles\":%.0f,\"interrupts\":%u,"
+        "\"isr_host_cycles\":%.0f,\"eeprom_writes\":%u,"
+        "\"power_cycles\":%u,\"wdt_resets\":%u,\"restore\":\"%s\","
+        "\"drive_on_ticks\":%.1f,\"restore_time\":%u}\n",
+        s->name, (double)end/CPU_HZ, seconds[MODE_ACTIVE], seconds[MODE_IDLE],
+        seconds[MODE_POWER_DOWN], uah, loops, (double)loop_host_cycles/loops,
+        interrupts, (double)usi_host_cycles/interrupts, eeprom_writes,
+        power_cycles, wdt_resets, restore_path, drive_on_ticks,
+        counters.RESTORE_TIME);
+}
+
+int main(int argc, char **argv)
+{
+    uint8_t i;
+    int n, status, failed = 0;
+
+    for (i=0; i<sizeof(scenarios)/sizeof(scenarios[0]); i++)
+    {
+        for (n=1; n<argc && strcmp(argv[n], scenarios[i].name); n++)
+            ;
+        if (argc>1 && n==argc)
+            continue;
+
+        fflush(stdout);
+        if (fork()==0)
+        {
+            run(&scenarios[i]);
+            exit(0);
+        }
+        wait(&status);
+        failed |= !WIFEXITED(status) || WEXITSTATUS(status);
+    }
+    return failed;
+}
@@ -0,0 +1,30 @@
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+/*
+ * I/O register storage for the host builds. Registers with side effects on
+ * write (flags cleared by writing 1) are reconciled by their model after
+ * the firmware ran, see usi_commit().
+ */
+
+volatile uint8_t PINB, DDRB, PORTB;
+volatile uint8_t USICR, USISR, USIDR;
+volatile uint8_t TCCR1, TCNT1, OCR1A, OCR1B, OCR1C;
+volatile uint8_t TCCR0A, TCCR0B, TCNT0, OCR0A, OCR0B;
+volatile uint8_t TIMSK, TIFR, GTCCR;
+volatile uint8_t GIMSK, PCMSK;
+volatile uint8_t ACSR, PRR, MCUCR, MCUSR, WDTCR;
+volatile uint8_t DIDR0, ADMUX, ADCSRA, EECR;
+volatile uint16_t ADC;
+
+uint8_t sim_interrupts;
+
+void sei(void)
+{
+    sim_interrupts = 1;
+}
+
+void cli(void)
+{
+    sim_interrupts = 0;
+}
@@ -0,0 +1,270 @@
+/*
+ * Fuzz harness for the USI TWI slave state machine in twi_slave.c, run
+ * against the bit level USI model in usi.c.
+ *
+ * The first two input bytes set the poll window, the third the size of the
+ * mapped page. Each following byte is a master operation:
+ *   bits 7-5: 0 start, 1 stop, 2 timer tick (after corrupting the 
+ *             overflow state if bit 4), 3 single bit (bit 0),
+ *             4 write the next input byte, 5 read a byte (NACK if bit 0),
+ *             6 abnormal start (stop if bit 0, else stuck), 
+ *             7 address the slave (read if bit 0)
+ * Out of bounds accesses are caught by the address sanitizer. SCL held by
+ * the slave for longer than the stall timeout, or a slave that does not
+ * answer a well-formed transaction afterwards, abort. So does SDA held low
+ * by the slave for that long while the master is idle, which blocks the bus
+ * for every other device.
+ *
+ * Built with -DFUZZER this is a libFuzzer target. Otherwise it replays the
+ * files given on the command line, or runs pseudo-random inputs and then
+ * measures the throughput of the state machine.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "usi.h"
+#include "../twi_slave.c"
+
+#define SLAVE_ADDRESS 0x62
+#define PAGE_MAX 32
+
+registers_t out_regs;
+registers_in_t in_regs;
+
+static uint8_t held_ticks;
+static uint8_t corrupted;
+
+static void fail(const char *what)
+{
+    fprintf(stderr, "twi_fuzz: %s (state %d, reg %d)\n", what, overflowState, twi_reg);
+    abort();
+}
+
+static void tick(void)
+{
+    usi_run(twi_tick);
+    if (!usi_held() && !usi_sda_low())
+        held_ticks = 0;
+    else if (++held_ticks>TWI_STALL_TICKS+1)
+        fail("bus held low");
+}
+
+static void reset(const uint8_t *page, uint8_t page_size)
+{
+    uint8_t i;
+
+    usi_reset();
+    for (i=0; i<sizeof(registers_t); i++)
+        ((uint8_t *)&out_regs)[i] = 0xA0 + i;
+    memset(&in_regs, 0, sizeof(in_regs));
+    out_regs.POLL_LENGTH = 0;
+    twi_page_buf = 0;
+    twi_page_size = 0;
+    twi_init(SLAVE_ADDRESS);
+    usi_commit();
+    twi_set_page(page, page_size);
+    held_ticks = 0;
+}
+
+// a well-formed register write, then a pointer write and a read back, 
+// neither of which may be taken for a stalled bus
+static void idle(void)
+{
+    uint8_t i, recoveries = out_regs.BUS_RECOVERIES;
+
+    for (i=0; i<=2*TWI_STALL_TICKS; i++)
+        tick();
+    if (out_regs.BUS_RECOVERIES!=recoveries)
+        fail("idle bus taken for a stall");
+}
+
+static void check_alive(void)
+{
+    uint8_t i, b;
+
+    usi_stop();
+    for (i=0; i<=TWI_STALL_TICKS; i++)
+        tick();
+
+    out_regs.POLL_LENGTH = 0;
+    usi_start(USI_START_OK);
+    // STATUS goes through in_regs, WATCHDOG is written in place
+    if (usi_write(SLAVE_ADDRESS<<1)!=0 || usi_write(0)!=0 || 
+        usi_write(0x5A)!=0 || usi_write(0xA5)!=0)
+        fail("write not acknowledged");
+    usi_stop();
+    if (in_regs.STATUS!=0x5A || out_regs.WATCHDOG!=0xA5)
+        fail("write lost");
+    idle();
+
+    usi_start(USI_START_OK);
+    if (usi_write(SLAVE_ADDRESS<<1)!=0 || usi_write(0)!=0)
+        fail("pointer write not acknowledged");
+    usi_start(USI_START_OK);
+    if (usi_write((SLAVE_ADDRESS<<1) | 1)!=0)
+        fail("read not acknowledged");
+    for (i=0; i<4; i++)
+    {
+        if (usi_read(&b, i==3)==USI_HELD || b!=((uint8_t *)&out_regs)[i])
+            fail("read back");
+    }
+    usi_stop();
+    idle();
+}
+
+static void run(const uint8_t *data, size_t size)
+{
+    static uint8_t *page;
+    uint8_t b;
+    size_t i = 3;
+
+    if (size<3)
+        return;
+
+    // heap allocated so that the sanitizer sees accesses past its end
+    free(page);
+    page = malloc(data[2] % PAGE_MAX + 1);
+    memset(page, 0x55, data[2] % PAGE_MAX + 1);
+    reset(page, data[2] % PAGE_MAX);
+    corrupted = 0;
+    out_regs.POLL_START = data[0];
+    out_regs.POLL_LENGTH = data[1];
+
+    while (i<size)
+    {
+        b = data[i++];
+        // the bus is only stuck while the master is idle
+        if ((b>>5)!=2)
+            held_ticks = 0;
+        switch (b>>5) {
+            case 0:
+                usi_start(USI_START_OK);
+                break;
+            case 1:
+                usi_stop();
+                break;
+            case 2:
+                if (b & 0x10)
+                {
+                    overflowState = USI_SLAVE_GET_DATA_AND_SEND_ACK_NEXT + 1 + (b & 0x0F);
+                    corrupted = 1;
+                }
+                tick();
+                break;
+            case 3:
+                usi_bit(b);
+                break;
+            case 4:
+                if (i<size)
+                    usi_write(data[i++]);
+                break;
+            case 5:
+                usi_read(&b, b & 1);
+                break;
+            case 6:
+                usi_start((b & 1) ? USI_START_STOP : USI_START_STUCK);
+                break;
+            case 7:
+                usi_write((SLAVE_ADDRESS<<1) | (b & 1));
+                break;
+        }
+        if (overflowState<=USI_SLAVE_GET_DATA_AND_SEND_ACK_NEXT)
+            corrupted = 0;
+        else if (!corrupted)
+            fail("invalid state");
+    }
+    check_alive();
+}
+
+#ifdef FUZZER
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    run(data, size);
+    return 0;
+}
+
+#else
+
+#define RANDOM_INPUTS   200000
+#define RANDOM_SIZE     64
+#define BENCH_POLLS     200000
+
+static uint32_t xorshift(void)
+{
+    static uint32_t x = 2463534242u;
+    x ^= x<<13;
+    x ^= x>>17;
+    x ^= x<<5;
+    return x;
+}
+
+static void replay(const char *path)
+{
+    static uint8_t data[4096];
+    size_t size;
+    FILE *f = fopen(path, "rb");
+
+    if (!f)
+    {
+        perror(path);
+        exit(1);
+    }
+    size = fread(data, 1, sizeof(data), f);
+    fclose(f);
+    run(data, size);
+}
+
+// pointer write, repeated start and an 8 byte read, as a host poll
+static double bench(void)
+{
+    uint8_t page[1];
+    uint8_t b;
+    uint32_t n, i;
+    clock_t t;
+
+    reset(page, 0);
+    t = clock();
+    for (n=0; n<BENCH_POLLS; n++)
+    {
+        usi_start(USI_START_OK);
+        usi_write(SLAVE_ADDRESS<<1);
+        usi_write(0);
+        usi_start(USI_START_OK);
+        usi_write((SLAVE_ADDRESS<<1) | 1);
+        for (i=0; i<8; i++)
+            usi_read(&b, i==7);
+        usi_stop();
+    }
+    t = clock()-t;
+    return BENCH_POLLS / ((double)t / CLOCKS_PER_SEC);
+}
+
+int main(int argc, char **argv)
+{
+    uint8_t data[RANDOM_SIZE];
+    uint32_t n, i;
+
+    if (argc>1)
+    {
+        for (n=1; n<(uint32_t)argc; n++)
+            replay(argv[n]);
+        return 0;
+    }
+
+    for (n=0; n<RANDOM_INPUTS; n++)
+    {
+        for (i=0; i<RANDOM_SIZE; i++)
+            data[i] = xorshift();
+        run(data, 3 + xorshift() % (RANDOM_SIZE-3));
+    }
+    printf("random_inputs=%u\n", RANDOM_INPUTS);
+    printf("transactions_per_second=%.0f\n", bench());
+    return 0;
+}
+
+#endif
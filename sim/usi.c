@@ -0,0 +1,195 @@
+#include <avr/io.h>
+#include "usi.h"
+
+/*
+ * Bit level model of the USI in two-wire mode, as seen by a slave driver.
+ * The master clocks bits one at a time: each bit is shifted into USIDR and
+ * counts two edges on the 4-bit counter, whose overflow raises the USI
+ * overflow interrupt. SDA is the wired AND of the master and of the MSB of
+ * USIDR while the slave drives the pin.
+ *
+ * USISR flags are cleared by writing 1 to them, which a plain variable
+ * cannot do: the low nibble (counter) reads back as USISR_UNTOUCHED, and a
+ * different value after the firmware ran means that it wrote USISR.
+ */
+
+#define USISR_UNTOUCHED 0x0F
+#define USISR_FLAGS ((1<<USISIF) | (1<<USIOIF) | (1<<USIPF))
+
+#define PIN_SDA (1<<PB0)
+#define PIN_SCL (1<<PB2)
+
+static uint8_t usi_flags;
+static uint8_t usi_count;
+static uint32_t usi_raised;
+
+uint64_t usi_host_cycles;
+
+static void usi_expose(void)
+{
+    USISR = usi_flags | USISR_UNTOUCHED;
+}
+
+// take the firmware's writes to USISR into account
+void usi_commit(void)
+{
+    if ((USISR & 0x0F)!=USISR_UNTOUCHED)
+    {
+        usi_flags &= ~(USISR & USISR_FLAGS);
+        usi_count = USISR & 0x0F;
+    }
+    usi_expose();
+}
+
+#define HOST_PREEMPTED  100000
+
+uint64_t host_cycles_since(uint64_t t)
+{
+    static uint64_t overhead = UINT64_MAX;
+    uint64_t d = __rdtsc() - t;
+    uint8_t i;
+
+    if (overhead==UINT64_MAX)
+    {
+        for (i=0; i<100; i++)
+        {
+            uint64_t s = __rdtsc();
+            uint64_t e = __rdtsc() - s;
+            if (e<overhead)
+                overhead = e;
+        }
+    }
+    // a preempted measurement is dropped
+    if (d>=HOST_PREEMPTED)
+        return 0;
+    return d>overhead ? d-overhead : 0;
+}
+
+// run firmware code that may access the USI, counting its host cycles
+void usi_run(void (*handler)(void))
+{
+    uint64_t t;
+
+    usi_expose();
+    t = __rdtsc();
+    handler();
+    usi_host_cycles += host_cycles_since(t);
+    usi_commit();
+}
+
+void usi_reset(void)
+{
+    usi_flags = 0;
+    usi_count = 0;
+    USICR = 0;
+    USIDR = 0;
+    PINB |= PIN_SDA | PIN_SCL;
+    usi_expose();
+}
+
+// number of interrupts raised since the last call
+uint32_t usi_interrupts(void)
+{
+    uint32_t n = usi_raised;
+
+    usi_raised = 0;
+    return n;
+}
+
+// SCL is held low by the start detector or on overflow in hold mode
+uint8_t usi_held(void)
+{
+    if (!(USICR & (1<<USIWM1)))
+        return 0;
+    if (usi_flags & (1<<USISIF))
+        return 1;
+    return (USICR & (1<<USIWM0)) && (usi_flags & (1<<USIOIF));
+}
+
+// the slave drives SDA low, e.g. an ACK or a 0 data bit
+uint8_t usi_sda_low(void)
+{
+    return (USICR & (1<<USIWM1)) && (DDRB & PIN_SDA) && !(USIDR & 0x80);
+}
+
+// start and stop conditions need SDA to be released by the slave
+void usi_start(uint8_t pins)
+{
+    if (!(USICR & (1<<USIWM1)) || usi_sda_low())
+        return;
+    usi_flags |= (1<<USISIF);
+    PINB = (PINB & ~(PIN_SDA | PIN_SCL)) | pins;
+    if (USICR & (1<<USISIE))
+    {
+        usi_raised++;
+        usi_run(USI_START_vect);
+    }
+    PINB &= ~(PIN_SDA | PIN_SCL);
+}
+
+void usi_stop(void)
+{
+    if (usi_sda_low())
+        return;
+    PINB |= PIN_SDA | PIN_SCL;
+    if (USICR & (1<<USIWM1))
+        usi_flags |= (1<<USIPF);
+    usi_expose();
+}
+
+uint8_t usi_bit(uint8_t bit)
+{
+    uint8_t sda = bit & 1;
+
+    if (usi_held())
+        return USI_HELD;
+    if (!(USICR & (1<<USIWM1)))
+        return sda;
+
+    if ((DDRB & PIN_SDA) && !(USIDR & 0x80))
+        sda = 0;
+    USIDR = (USIDR<<1) | sda;
+
+    usi_count += 2;
+    if (usi_count>=16)
+    {
+        usi_count -= 16;
+        usi_flags |= (1<<USIOIF);
+        if (USICR & (1<<USIOIE))
+        {
+            usi_raised++;
+            usi_run(USI_OVF_vect);
+        }
+    }
+    usi_expose();
+    return sda;
+}
+
+// master writes a byte, returns the ACK bit (0 for ACK)
+uint8_t usi_write(uint8_t byte)
+{
+    int8_t i;
+
+    for (i=7; i>=0; i--)
+    {
+        if (usi_bit(byte>>i)==USI_HELD)
+            return USI_HELD;
+    }
+    return usi_bit(1);
+}
+
+// master reads a byte and acknowledges it unless nack is set
+uint8_t usi_read(uint8_t *byte, uint8_t nack)
+{
+    uint8_t i, b;
+
+    *byte = 0;
+    for (i=0; i<8; i++)
+    {
+        b = usi_bit(1);
+        if (b==USI_HELD)
+            return USI_HELD;
+        *byte = (*byte<<1) | b;
+    }
+    return usi_bit(nack);
+}
@@ -0,0 +1,43 @@
+#ifndef _SIM_USI_H_
+#define _SIM_USI_H_
+
+#include <stdint.h>
+#include <x86intrin.h>
+
+// host cycles spent in the handlers run by usi_run()
+extern uint64_t usi_host_cycles;
+
+// cycles since a __rdtsc() reading, without the cost of the reading
+uint64_t host_cycles_since(uint64_t t);
+
+// returned by the master operations when the slave holds SCL low
+#define USI_HELD 0xFF
+
+// pin levels seen by the start ISR after a start condition
+#define USI_START_OK    0x00    // SCL low: start condition completed
+#define USI_START_STOP  0x05    // SCL and SDA high: stop right after start
+#define USI_START_STUCK 0x04    // SCL high, SDA low: start never completes
+
+void usi_reset(void);
+
+void usi_run(void (*handler)(void));
+
+void usi_commit(void);
+
+uint32_t usi_interrupts(void);
+
+uint8_t usi_held(void);
+
+uint8_t usi_sda_low(void);
+
+void usi_start(uint8_t pins);
+
+void usi_stop(void);
+
+uint8_t usi_bit(uint8_t bit);
+
+uint8_t usi_write(uint8_t byte);
+
+uint8_t usi_read(uint8_t *byte, uint8_t nack);
+
+#endif
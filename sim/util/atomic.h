@@ -0,0 +1,9 @@
+#ifndef _SIM_UTIL_ATOMIC_H_
+#define _SIM_UTIL_ATOMIC_H_
+
+// interrupts only run when a model raises them, so every block is atomic
+#define ATOMIC_RESTORESTATE 0
+#define ATOMIC_FORCEON      1
+#define ATOMIC_BLOCK(type) for (uint8_t _sim_once = 1; _sim_once; _sim_once = 0)
+
+#endif
@@ -2,25 +2,44 @@
 #include <avr/interrupt.h>
 #include "timer.h"
 #include "registers.h"
+#include "led.h"
+#include "twi_slave.h"
+#include "counters.h"
+
+// 8 000 000 / (8192 * 39) -> approx 25 ticks per second
+#define TIMER_TICK_COUNTS 39
 
 volatile uint8_t button_press;
 
+/*
+ * Timer1 runs free from 0 to 255 and OCR1A is moved forward by one tick
+ * period at every interrupt. The ticks due are computed from TCNT1, so an
+ * interrupt delayed by other ISRs or atomic blocks catches up instead of
+ * losing time. TOV1 tells a late interrupt that the counter made a full 
+ * lap, which makes delays shorter than 512 - timer_last counts recoverable:
+ * at least 257 counts (approx 0.26s) whatever timer_last is.
+ */
+static uint8_t timer_last;
+    // TCNT1 when the last interrupt ran
+
+static uint16_t timer_phase;
+    // counts elapsed since the last tick
+
 void timer_open(void)
 {
-    out_regs.TICKS = 0;
     button_press = 0;
+    timer_last = 0;
+    timer_phase = 0;
 
     TCCR1 = 0;
-     // set up timer with prescaler = 8192, CTC mode
-    TCCR1 = (1 << CS13) | (1 << CS12) | (1 << CS11) | (1 << CTC1);
+     // set up timer with prescaler = 8192, free running
+    TCCR1 = (1 << CS13) | (1 << CS12) | (1 << CS11);
 
     // initialize counter
     TCNT1 = 0;
 
-    // 8 000 000 / (8192 * 39) -> approx 25 ticks per second 
-    // We substract 1 to 39, since we count from 0 to 38 to get 39 ticks
-    OCR1A = 38;
-    OCR1C = 38;
+    OCR1A = TIMER_TICK_COUNTS;
+    TIFR = (1 << OCF1A) | (1 << TOV1);
   
     // enable compare interrupt
     TIMSK |= (1 << OCIE1A);
@@ -35,9 +54,52 @@ static uint8_t state;
 
 ISR ( TIMER1_COMPA_vect )
 {
-    out_regs.TICKS++;
-    state = ((state<<1) | ((PINB >> 4) & 1))&0x0F;
+    // read the overflow flag first, so a wrap between the two reads can 
+    // only show as now < timer_last
+    uint8_t wrapped = TIFR & (1 << TOV1);
+    uint8_t now = TCNT1;
+    uint16_t elapsed = (uint8_t)(now - timer_last);
+    uint8_t due = 0;
+
+    if (now < timer_last)
+    {
+        // the expected wrap, already counted by the 8 bit difference: clear
+        // its flag even if it was raised after the read, else the next 
+        // interrupt would take it for a full lap
+        TIFR = (1 << TOV1);
+    }
+    else if (wrapped)
+    {
+        // the counter went all the way round
+        TIFR = (1 << TOV1);
+        elapsed += 256;
+    }
+    timer_last = now;
+
+    timer_phase += elapsed;
+    while (timer_phase >= TIMER_TICK_COUNTS)
+    {
+        timer_phase -= TIMER_TICK_COUNTS;
+        due++;
+    }
+    OCR1A = now + (TIMER_TICK_COUNTS - timer_phase);
+
+    if (due == 0)
+        return;
+    out_regs.TICKS += due;
+    if (due > 1)
+    {
+        // saturating add
+        if (counters.MISSED_TICKS > 0xFFFF - (due - 1))
+            counters.MISSED_TICKS = 0xFFFF;
+        else
+            counters.MISSED_TICKS += due - 1;
+    }
+
+    state = ((state<<1) | ((PINB >> 4) & 1)) & ((1<<BUTTON_DEBOUNCE_TICKS)-1);
     button_press = (state==0x00);
+    led_tick();
+    twi_tick();
 }
 
 extern uint32_t timer_ticks(void);
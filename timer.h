@@ -11,6 +11,9 @@ void timer_close(void);
 
 #include <registers.h>
 
+// the button is pressed once that many samples, one per tick, saw it low
+#define BUTTON_DEBOUNCE_TICKS 4
+
 extern volatile uint8_t button_press;
 
 __attribute__((always_inline)) inline uint32_t timer_ticks(void) 
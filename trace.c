@@ -0,0 +1,22 @@
+#include "trace.h"
+
+#ifdef TRACE
+
+/*
+ * ISR trace ring. Recording stops at the first I2C failure (a bus recovery
+ * or an unknown USI state), so the transaction selecting the trace page to
+ * read it does not overwrite the entries that led to the failure. It also
+ * stops while the trace page is selected, and resumes once it is left.
+ */
+
+trace_t trace;
+volatile uint8_t trace_frozen;
+
+void trace_freeze(uint8_t frozen)
+{
+    trace_frozen = frozen;
+}
+
+extern void trace_record(uint8_t isr, uint8_t state, uint8_t data);
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+
+#define TRACE_USI_START     1
+#define TRACE_USI_OVERFLOW  2
+#define TRACE_TIMER         3
+#define TRACE_PCINT         4
+
+#ifdef TRACE
+
+#define TRACE_DEPTH 16  // must be a power of 2, holds a register read
+
+typedef struct {
+    uint8_t TAG;
+        // bits 7-4: ISR (TRACE_USI_START, ...)
+        // bits 3-0: USI overflow state
+    uint8_t DATA;
+        // USIDR for USI interrupts, USISR for the timer, PINB for PCINT
+        // (the timer records a tick while a transaction is in progress, 
+        // which dates the entries around it)
+} __attribute__ ((__packed__)) trace_entry_t;
+
+typedef struct {
+    uint8_t HEAD;
+        // index of the next entry to be written, i.e. of the oldest entry
+    trace_entry_t ENTRIES[TRACE_DEPTH];
+} __attribute__ ((__packed__)) trace_t;
+
+extern trace_t trace;
+extern volatile uint8_t trace_frozen;
+
+__attribute__((always_inline)) inline void trace_record(uint8_t isr, uint8_t state, uint8_t data)
+{
+    trace_entry_t *e;
+
+    if (trace_frozen)
+        return;
+    e = &trace.ENTRIES[trace.HEAD];
+    e->TAG = (isr<<4) | state;
+    e->DATA = data;
+    trace.HEAD = (trace.HEAD+1) & (TRACE_DEPTH-1);
+}
+
+void trace_freeze(uint8_t frozen);
+
+// a failure: stop recording, so that the entries leading to it are kept
+#define trace_trigger() (trace_frozen = 1)
+
+#else
+
+#define trace_record(isr, state, data)
+#define trace_trigger()
+
+#endif
+
+#endif
@@ -35,6 +35,11 @@ Change Activity:
   10 Feb 2015  Simplied RX/TX buffer code and allowed use of full buffer.
   12 Dec 2016  Added support for ATtiny167
   06 Deb 2019  Changed to a register based approach, removed unused code.
+  18 Oct 2026  Recover from unknown overflow states instead of stalling.
+  18 Oct 2026  Added bus-hang detection and automatic USI recovery.
+  18 Oct 2026  Added optional ISR tracing.
+  18 Oct 2026  Added performance counters.
+  18 Oct 2026  Added a poll window for reads without a register write.
   
 
 ********************************************************************************/
@@ -44,11 +49,16 @@ Change Activity:
                                     includes
 ********************************************************************************/
 
+#include <stddef.h>
 #include <avr/io.h>
 #include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <util/atomic.h>
 
 #include "twi_slave.h"
 #include "registers.h"
+#include "trace.h"
+#include "counters.h"
 
 /********************************************************************************
                             device dependent defines
@@ -290,6 +300,13 @@ typedef enum
 
 ********************************************************************************/
 
+// number of timer ticks a transaction may stall before the USI is reset
+#define TWI_STALL_TICKS 6
+
+// number of polling iterations (approx 2ms) to wait for a Start Condition to
+// complete before giving up
+#define TWI_START_SPIN 2048
+
 #define TWI_RX_BUFFER_SIZE sizeof(registers_t)
 #define TWI_TX_BUFFER_SIZE sizeof(registers_t)
 
@@ -298,11 +315,54 @@ static uint8_t                  slaveAddress;
 static volatile overflowState_t overflowState;
 
 
-uint8_t *twi_rx_buf = (uint8_t *)(&in_regs);
+#define twi_rx_buf ((uint8_t *)(&in_regs))
+
+// position + 1 in twi_rx_buf of each register byte, TWI_RX_IN_PLACE for
+// those written straight into twi_tx_buf, 0 for read-only ones
+#define TWI_RX_IN_PLACE 0xFF
+#define TWI_RX(r, n) \
+    [ offsetof( registers_t, r ) + n ] = offsetof( registers_in_t, r ) + n + 1
+#define TWI_RX_BYTE(r) TWI_RX( r, 0 )
+#define TWI_RX_WORD(r) TWI_RX( r, 0 ), TWI_RX( r, 1 )
+#define TWI_TX_BYTE(r) [ offsetof( registers_t, r ) ] = TWI_RX_IN_PLACE
+#define TWI_TX_WORD(r) TWI_TX_BYTE( r ), \
+    [ offsetof( registers_t, r ) + 1 ] = TWI_RX_IN_PLACE
+
+static const uint8_t twi_rx_map[ TWI_RX_BUFFER_SIZE ] PROGMEM = {
+  TWI_RX_BYTE( STATUS ),
+  TWI_TX_BYTE( WATCHDOG ),
+  TWI_TX_WORD( REBOOT ),
+  TWI_RX_BYTE( VERSION ),
+  TWI_RX_BYTE( DEFAULT_WATCHDOG ),
+  TWI_RX_WORD( DEFAULT_REBOOT ),
+  TWI_TX_BYTE( GRACE ),
+  TWI_RX_BYTE( LED ),
+  TWI_RX_BYTE( LED_ARG ),
+  TWI_RX_BYTE( PAGE ),
+  TWI_TX_WORD( SLOT_ON ),
+  TWI_TX_WORD( SLOT_OFF ),
+  TWI_TX_BYTE( SLOT_REPEAT ),
+  TWI_RX_BYTE( SLOT ),
+  TWI_RX_BYTE( DEFAULT_BOOT_GRACE ),
+  TWI_RX_BYTE( BACKOFF ),
+  TWI_RX_WORD( BACKOFF_CAP ),
+  TWI_RX_BYTE( FAIL_LIMIT ),
+  TWI_TX_WORD( CMD_ARG ),
+  TWI_RX_BYTE( CMD ),
+  TWI_RX_BYTE( POLL_START ),
+  TWI_RX_BYTE( POLL_LENGTH ),
+};
+
 static volatile uint8_t twi_rx_count;
-uint8_t *twi_tx_buf = (uint8_t *)(&out_regs);
+#define twi_tx_buf ((uint8_t *)(&out_regs))
 static volatile uint8_t twi_tx_count;
 static volatile uint8_t twi_reg;
+static volatile uint8_t twi_reg_set;
+static volatile uint8_t twi_poll;
+static const uint8_t * volatile twi_page_buf;
+static volatile uint8_t twi_page_size;
+static volatile uint8_t twi_progress;
+static uint8_t twi_stall;
 
 
 
@@ -314,13 +374,14 @@ static volatile uint8_t twi_reg;
 
 
 
-// flushes the TWI buffers
+// flushes the TWI buffers - the transfer counts are kept, a reset would 
+// otherwise show as bus activity in twi_has_received()/twi_has_transmitted()
 
 static void twi_reset_buffers(void)
 {
-  twi_rx_count = 0;
-  twi_tx_count = 0;
   twi_reg = 0;
+  twi_reg_set = 0;
+  twi_poll = 0;
 } // end flushTwiBuffers
 
 
@@ -401,6 +462,19 @@ int8_t twi_has_received(void)
     return 0;
 } 
 
+void twi_set_page(const uint8_t *buf, uint8_t size)
+{
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        twi_page_buf = buf;
+        twi_page_size = size;
+    }
+}
+
+uint8_t twi_page_length(void)
+{
+    return twi_page_size;
+}
+
 void twi_close(void)
 {
     USICR = 0;
@@ -408,6 +482,52 @@ void twi_close(void)
     DDR_USI &= ~(( 1 << PORT_USI_SCL ) | ( 1 << PORT_USI_SDA ));
 }
 
+// reset the USI, called from the timer interrupt when the bus is stuck
+
+static void twi_recover(void)
+{
+    trace_trigger();
+    twi_close();
+    twi_init(slaveAddress);
+    if (out_regs.BUS_RECOVERIES!=0xFF)
+        out_regs.BUS_RECOVERIES++;
+}
+
+// called from the timer interrupt: a transaction that neither progresses nor 
+// ends with a Stop Condition for TWI_STALL_TICKS means the master went away,
+// possibly leaving SCL held low by the USI.
+
+void twi_tick(void)
+{
+    if ( USICR & ( 1 << USIOIE ) )
+    {
+        trace_record( TRACE_TIMER, overflowState, USISR );
+    }
+
+    // a Stop Condition ends the transaction, even in the middle of a byte 
+    // the master stopped clocking: release SDA and wait for the next Start
+    if ( ( USICR & ( 1 << USIOIE ) ) && ( USISR & ( 1 << USIPF ) ) )
+    {
+        DDR_USI &= ~( 1 << PORT_USI_SDA );
+        SET_USI_TO_TWI_START_CONDITION_MODE( );
+    }
+
+    if ( ( USICR & ( 1 << USIOIE ) ) && 
+         !twi_progress )
+    {
+        if ( ++twi_stall >= TWI_STALL_TICKS )
+        {
+            twi_stall = 0;
+            twi_recover();
+        }
+    }
+    else
+    {
+        twi_stall = 0;
+    }
+    twi_progress = 0;
+}
+
 /********************************************************************************
 
                             USI Start Condition ISR
@@ -416,6 +536,10 @@ void twi_close(void)
 
 ISR( USI_START_VECTOR )
 {
+  uint16_t spin = TWI_START_SPIN;
+
+  trace_record( TRACE_USI_START, overflowState, USIDR );
+
   // set default starting conditions for new TWI package
   overflowState = USI_SLAVE_CHECK_ADDRESS;
 
@@ -426,16 +550,31 @@ ISR( USI_START_VECTOR )
   // start detector will hold SCL low ) - if a Stop Condition arises then leave
   // the interrupt to prevent waiting forever - don't use USISR to test for Stop
   // Condition as in Application Note AVR312 because the Stop Condition Flag is
-  // going to be set from the last TWI sequence
+  // going to be set from the last TWI sequence - a bus stuck in that state
+  // is given up on after TWI_START_SPIN iterations
   while (
        // SCL his high
        ( PIN_USI & ( 1 << PIN_USI_SCL ) ) &&
        // and SDA is low
-       !( ( PIN_USI & ( 1 << PIN_USI_SDA ) ) )
+       !( ( PIN_USI & ( 1 << PIN_USI_SDA ) ) ) &&
+       --spin
   );
 
+  if ( spin==0 )
+  {
+    trace_trigger();
+    if ( out_regs.BUS_RECOVERIES!=0xFF )
+    {
+      out_regs.BUS_RECOVERIES++;
+    }
+  }
+
+  if ( ( uint16_t )( TWI_START_SPIN - spin ) > counters.ISR_MAX )
+  {
+    counters.ISR_MAX = TWI_START_SPIN - spin;
+  }
 
-  if ( !( PIN_USI & ( 1 << PIN_USI_SDA ) ) )
+  if ( spin && !( PIN_USI & ( 1 << PIN_USI_SDA ) ) )
   {
 
     // a Stop Condition did not occur
@@ -499,6 +638,9 @@ Only disabled when waiting for a new Start Condition.
 ISR( USI_OVERFLOW_VECTOR )
 {
 
+  trace_record( TRACE_USI_OVERFLOW, overflowState, USIDR );
+  twi_progress = 1;
+
   switch ( overflowState )
   {
 
@@ -509,16 +651,26 @@ ISR( USI_OVERFLOW_VECTOR )
           {
               if ( USIDR & 0x01 )
               {
+                  // a read without a register write starts at the poll
+                  // window
+                  twi_poll = !twi_reg_set && out_regs.POLL_LENGTH;
+                  if ( twi_poll )
+                  {
+                      twi_reg = out_regs.POLL_START;
+                  }
+                  twi_reg_set = 0;
                   overflowState = USI_SLAVE_SEND_DATA;
               }
               else
               {
                   overflowState = USI_SLAVE_REQUEST_DATA_START;
               } // end if
+              COUNTER_INC( TRANSACTIONS );
               SET_USI_TO_SEND_ACK( );
           }
           else
           {
+              COUNTER_INC( NACKS );
               SET_USI_TO_TWI_START_CONDITION_MODE( );
           }
           break;
@@ -538,12 +690,23 @@ ISR( USI_OVERFLOW_VECTOR )
           // copy data from buffer to USIDR and set USI to shift byte
           // next USI_SLAVE_REQUEST_REPLY_FROM_SEND_DATA
       case USI_SLAVE_SEND_DATA:
+          // wrap around within the poll window
+          if ( twi_poll && 
+               twi_reg == ( uint8_t )( out_regs.POLL_START + out_regs.POLL_LENGTH ) )
+          {
+              twi_reg = out_regs.POLL_START;
+          }
           // Get data from Buffer
           if ( twi_reg < TWI_TX_BUFFER_SIZE )
           {
               USIDR = twi_tx_buf[ twi_reg++ ];
               twi_tx_count++;
           }
+          else if ( ( uint8_t )( twi_reg - TWI_PAGE_BASE ) < twi_page_size )
+          {
+              USIDR = twi_page_buf[ twi_reg++ - TWI_PAGE_BASE ];
+              twi_tx_count++;
+          }
           else
           {
               // the buffer is empty
@@ -576,6 +739,7 @@ ISR( USI_OVERFLOW_VECTOR )
           // put data into buffer
           // check buffer size
           twi_reg = USIDR;
+          twi_reg_set = 1;
           // next USI_SLAVE_REQUEST_DATA
           overflowState = USI_SLAVE_REQUEST_DATA_NEXT;
           SET_USI_TO_SEND_ACK( );
@@ -596,16 +760,36 @@ ISR( USI_OVERFLOW_VECTOR )
           // check buffer size
           if ( twi_reg < TWI_RX_BUFFER_SIZE )
           {
-              twi_rx_buf[ twi_reg++ ] = USIDR;
+              uint8_t rx = pgm_read_byte( &twi_rx_map[ twi_reg ] );
+
+              if ( rx==TWI_RX_IN_PLACE )
+              {
+                  twi_tx_buf[ twi_reg ] = USIDR;
+              }
+              else if ( rx )
+              {
+                  twi_rx_buf[ rx - 1 ] = USIDR;
+              }
+              twi_reg++;
               twi_rx_count++;
           } else {
               // overrun
               // drop data
+              COUNTER_INC( OVERRUNS );
           }
           // next USI_SLAVE_REQUEST_DATA
           overflowState = USI_SLAVE_REQUEST_DATA_NEXT;
           SET_USI_TO_SEND_ACK( );
           break;
+
+          // unknown state (e.g. corrupted overflowState): never leave the USI
+          // holding SCL or SDA, go back to waiting for a Start Condition
+      default:
+          trace_trigger();
+          overflowState = USI_SLAVE_CHECK_ADDRESS;
+          DDR_USI &= ~( 1 << PORT_USI_SDA );
+          SET_USI_TO_TWI_START_CONDITION_MODE( );
+          break;
   } // end switch
 
 } // end ISR( USI_OVERFLOW_VECTOR )
@@ -11,5 +11,14 @@ int8_t twi_has_received(void);
 
 void twi_close(void);
 
+void twi_tick(void);
+
+// read-only register page, mapped at TWI_PAGE_BASE after the registers
+#define TWI_PAGE_BASE 0x40
+
+void twi_set_page(const uint8_t *buf, uint8_t size);
+
+uint8_t twi_page_length(void);
+
 #endif
 